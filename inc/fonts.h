@@ -3,4 +3,5 @@
 #include <hb.h>
 
 void hbunloadfonts();
+size_t hbmemused(void);
 void hbtransform(XftGlyphFontSpec *, const Glyph *, size_t, int, int);
@@ -101,19 +101,26 @@ void kscrolldown(const Arg *);
 void kscrollup(const Arg *);
 void externalpipe(const Arg *);
 void printscreen(const Arg *);
+void memreport(const Arg *);
 void printsel(const Arg *);
 void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
 int    tattrset(int);
+void   tfulldirt(void);
+void   tlock(void);
 void   tnew(int, int);
 int    tisaltscreen(void);
 void   tresize(int, int);
 void   tsetdirtattr(int);
+void   tunlock(void);
+int    twrite(const char *, int, int);
+void   ttyclearwake(void);
 void   ttyhangup(void);
 int    ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
 void   ttyresize(int, int);
+int    ttythread(void);
 void   ttywrite(const char *, size_t, int);
 
 void resettitle(void);
@@ -154,3 +161,8 @@ extern unsigned int defaultbg;
 extern unsigned int defaultcs;
 extern const int    boxdraw, boxdraw_bold, boxdraw_braille;
 extern float        alpha;
+extern unsigned int ttyreadmax;
+extern unsigned int histsize;
+extern unsigned int histhot;
+extern int          histspill;
+extern unsigned int membudget;
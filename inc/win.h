@@ -39,3 +39,4 @@ void xsetpointermotion(int);
 void xsetsel(char *);
 int  xstartdraw(void);
 void xximspot(int, int);
+size_t xmemused(void);
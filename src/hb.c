@@ -35,6 +35,11 @@ void hbunloadfonts()
     hbfontslen = 0;
 }
 
+size_t hbmemused(void)
+{
+    return hbfontslen * sizeof(HbFontMatch);
+}
+
 hb_font_t *hbfindfont(XftFont *match)
 {
     for (int i = 0; i < hbfontslen; i++)
@@ -3,22 +3,32 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 #include <wchar.h>
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
 
 #include "st.h"
 #include "win.h"
+#include "width_data.h"
 
 #if defined(__linux)
     #include <pty.h>
@@ -35,8 +45,21 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define HISTSIZE      2000
-#define RESIZEBUFFER  1000
+#define HISTGROW      128
+#define HISTCACHE     8
+#define HISTBLOCK     256
+#define DEDUPSIZ      256
+#define HISTMAX       (INT_MAX / 4)
+#define SPILLSEG      (64 << 20)
+#define RUNE_BUF_SIZ  1024
+#define TTY_BUF_MAX   (32*BUFSIZ)
+#define STYLE_GC_MIN  4096
+
+#if defined(__AVX2__)
+    #define UTF8_BLK  32
+#elif defined(__SSE2__)
+    #define UTF8_BLK  16
+#endif
 
 /* macros */
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
@@ -45,14 +68,18 @@
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)		(u && wcschr(worddelimiters, u))
 
+#define CSTYLE(c)		(term.styles.s[(c).s])
+#define CMODE(c)		(CSTYLE(c).mode)
+#define LMETA(line)		((LineMeta *)(line) - 1)
+#define ROWSIZE(col)		(sizeof(LineMeta) + (col) * sizeof(Cell))
+
 #define TLINE(y) ( \
-	(y) < term.scr ? term.hist[(term.histi + (y) - term.scr + 1 + HISTSIZE) % HISTSIZE] \
-	               : term.line[(y) - term.scr] \
+	(y) < term.scr ? thistline(term.scr - (y)) \
+	               : tlinefill(term.line[(y) - term.scr], term.col) \
 )
-#define TLINE_HIST(y)           ((y) <= HISTSIZE-term.row+2 ? term.hist[(y)] : term.line[(y-HISTSIZE+term.row-3)])
 
 #define TLINEABS(y) ( \
-	(y) < 0 ? term.hist[(term.histi + (y) + 1 + HISTSIZE) % HISTSIZE] : term.line[(y)] \
+	(y) < 0 ? thistline(-(y)) : tlinefill(term.line[(y)], term.col) \
 )
 
 #define UPDATEWRAPNEXT(alt, col) do { \
@@ -99,16 +126,186 @@ enum charset {
 	CS_FIN
 };
 
+/*
+ * The escape parser is a DEC style state machine: every rune is sorted
+ * into a class, and vttable[state][class] gives the action to perform
+ * and the next state, packed as (action << 4 | state).
+ */
 enum escape_state {
-	ESC_START      = 1,
-	ESC_CSI        = 2,
-	ESC_STR        = 4,  /* DCS, OSC, PM, APC */
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END    = 16, /* a final string was encountered */
-	ESC_TEST       = 32, /* Enter in test mode */
-	ESC_UTF8       = 64,
+	ESC_GROUND,
+	ESC_ESCAPE,
+	ESC_CHARSET,    /* ESC ( ) * + */
+	ESC_TEST,       /* ESC # */
+	ESC_UTF8,       /* ESC % */
+	ESC_CSI_ENTRY,
+	ESC_CSI_PARAM,
+	ESC_CSI_INTER,
+	ESC_CSI_IGNORE,
+	ESC_STR,        /* DCS, OSC, PM, APC */
+	ESC_STR_ESC,    /* ESC inside a string, ST may follow */
+	ESC_NSTATES
+};
+
+enum escape_class {
+	CLS_C0,         /* C0 controls */
+	CLS_BEL,
+	CLS_CAN,        /* CAN and SUB, abort any sequence */
+	CLS_ESC,
+	CLS_DEL,
+	CLS_C1,         /* C1 controls */
+	CLS_INTER,      /* intermediates not listed below */
+	CLS_HASH,
+	CLS_PERCENT,
+	CLS_CHARSET,    /* ( ) * + */
+	CLS_DIGIT,
+	CLS_COLON,
+	CLS_SEMI,
+	CLS_PRIV,       /* < = > ? */
+	CLS_CSI,        /* [ */
+	CLS_ST,         /* backslash */
+	CLS_STR,        /* P ] ^ _ k */
+	CLS_FINAL,      /* finals not listed above */
+	CLS_PRINT,      /* printable runes above ASCII */
+	CLS_NCLASSES
+};
+
+enum escape_action {
+	ACT_NONE,
+	ACT_PRINT,
+	ACT_EXECUTE,
+	ACT_CLEAR,
+	ACT_ESCDISPATCH,
+	ACT_CHARSET,
+	ACT_DEFTRAN,
+	ACT_DECTEST,
+	ACT_DEFUTF8,
+	ACT_CSICOLLECT,
+	ACT_CSIDISPATCH,
+	ACT_STRSTART,
+	ACT_STRPUT,
+	ACT_STRDISPATCH
 };
 
+/* attributes shared by many cells, interned in term.styles */
+typedef struct {
+	ushort mode;
+	uint32_t fg;
+	uint32_t bg;
+} Style;
+
+/* a character of the screen or history, half the size of a Glyph */
+typedef struct {
+	Rune u;       /* character code */
+	uint32_t s;   /* index of its Style */
+} Cell;
+
+/*
+ * Kept in front of every screen row, see tslabnew(). len and attr are
+ * bounds: code adding to a row widens them, tlinelen() and tlineattr()
+ * tighten them again, so nothing else has to keep them.
+ *
+ * Clearing to the end of a row only moves clr, the cells from there on
+ * read as blanks of style clrs whatever they hold. tlinefill() writes
+ * them out for readers of whole rows, tlinetake() hands them to writers.
+ * A LineMeta of zeros is a row of default blanks, the style at 0.
+ */
+typedef struct {
+	int len;       /* no cell from len on has ATTR_SET or ATTR_WRAP */
+	ushort attr;   /* every ATTR_* in the row, maybe more */
+	uchar loose;   /* the row changed since attr was exact */
+	int clr;       /* the cells from clr on are blank, none if >= col */
+	uint32_t clrs; /* the style of those blanks */
+} LineMeta;
+
+/* the cells of a narrow HistLine up to end have style s */
+typedef struct {
+	int end;
+	uint32_t s;
+} StyleRun;
+
+/*
+ * A line of history, stored up to where its tail is all the same cell.
+ * Lines are immutable once stored, so repeated lines share one copy, see
+ * thistshare(). A line of ASCII is stored narrow where that is smaller:
+ * in place of its cells come runs StyleRuns, then a byte per rune.
+ */
+typedef struct {
+	int ref;      /* hist slots and term.dedup entries holding it */
+	int len;      /* cells stored */
+	int runs;     /* 0 unless the line is narrow */
+	Cell fill;    /* repeated from len to the width of the screen */
+	Cell c[];
+} HistLine;
+
+#define HRUN(h)			((StyleRun *)(h)->c)
+#define HTEXT(h)		((uchar *)(HRUN(h) + (h)->runs))
+
+/* a line recently stored in hist, by the hash of its content */
+typedef struct {
+	uint32_t hash;
+	HistLine *h;
+} Dedup;
+
+/*
+ * HISTBLOCK lines of cold history. Each line is its byte length, its
+ * length in cells, its fill cell, its runes as UTF-8 and runs of
+ * styles, all numbers as varints. Styles are stored by value, so
+ * tstylegc() never has to look at cold lines.
+ */
+typedef struct {
+	uchar *data;
+	size_t len;
+	int spilled;  /* data is in a spill file, not malloc()ed */
+} ColdBlock;
+
+/*
+ * A file of cold blocks for histspill, appended to and read through a
+ * map of SPILLSEG bytes that never moves. Files are unlinked as soon as
+ * they are made and closed once all of their blocks are dropped.
+ */
+typedef struct {
+	uchar *map;
+	int fd;
+	size_t len;   /* bytes written */
+	int blocks;   /* cold blocks still in it */
+} Spill;
+
+/* history lines expanded for reading, see thistline() */
+typedef struct {
+	int age;      /* 1 for the newest line of history, 0 if unused */
+	int col;      /* width of line */
+	Cell *line;
+} HistCache;
+
+/* lines of history still wrapped at an older width, see treflow() */
+typedef struct {
+	int n;        /* nb lines */
+	int col;      /* width they were wrapped at */
+} HistSeg;
+
+/*
+ * History rows that start a logical line, by id. Rows get ids in the
+ * order they enter history, so finding the logical line of a row is a
+ * binary search instead of a walk over the rows before it.
+ */
+typedef struct {
+	uint32_t *id;  /* oldest first, a ring */
+	int i;         /* slot of the oldest */
+	int n, siz;
+	uint32_t seq;  /* id of the newest row of history */
+	int wrap;      /* that row goes on in the next one */
+} ParaIndex;
+
+typedef struct {
+	Style *s;          /* 0 is the default style */
+	uint32_t n;        /* nb styles */
+	uint32_t siz;
+	uint32_t *hash;    /* open addressing, style index + 1 */
+	uint32_t hashsiz;  /* power of two, at least 2 * n */
+	uint32_t last;     /* last interned, checked first */
+	uint32_t gc;       /* tstylegc() once n reaches this */
+} StyleTable;
+
 typedef struct {
 	Glyph attr; /* current char attributes */
 	int x;
@@ -134,14 +331,45 @@ typedef struct {
 	int alt;
 } Selection;
 
+/* the rows of a screen in one block, see tslabnew() */
+typedef struct {
+	char *p;
+	size_t siz;
+} Slab;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
 	int col;      /* nb col */
-	Line *line;   /* screen */
-	Line hist[HISTSIZE]; /* history buffer */
+	Cell **line;  /* screen, a window of row rows into ring */
+	Cell **ring;  /* 2 * row rows, the second half mirrors the first */
+	Cell **altline, **altring; /* the other screen */
+	int altcol, altrow;  /* its size */
+	Slab slab, altslab; /* where the rows of the screens are */
+	Slab spare;   /* where resizing builds the next grid */
+	HistLine **hist; /* history ring, lines allocated as they scroll off */
+	Dedup dedup[DEDUPSIZ]; /* direct mapped */
+	int histn;    /* slots in hist, grows up to histsize */
+	int histh;    /* newest lines of history, kept in hist */
+	int histc;    /* older lines, compressed in cold */
+	ColdBlock *cold; /* oldest first */
+	int coldn, coldsiz;
+	int coldskip; /* lines of cold[0] already dropped */
+	int coldbusy; /* the compressor thread has work */
+	const uchar *coldidx; /* block whose line offsets are in coldoff */
+	Spill *spill; /* oldest first, see histspill */
+	int spilln, spillsiz;
+	size_t histmem; /* bytes of the lines in hist and dedup */
+	size_t coldmem; /* bytes of cold blocks kept in memory */
+	uint32_t coldoff[HISTBLOCK];
+	HistCache hcache[HISTCACHE];
+	int hcnext;   /* hcache entry to replace next */
 	int histi;           /* history index */
-	int histf;           /* nb history available */
+	int histf;           /* nb history available, histh + histc */
+	int histr;           /* newest lines of it, wrapped at col */
+	HistSeg *seg;        /* the older ones, newest first */
+	int segn;
+	ParaIndex para;      /* logical lines of history */
 	int scr;             /* scroll back */
 	int wrapcwidth[2];   /* used in updating WRAPNEXT when resizing */
 	int *dirty;   /* dirtyness of lines */
@@ -151,23 +379,42 @@ typedef struct {
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
 	int mode;     /* terminal mode flags */
-	int esc;      /* escape state flags */
+	int esc;      /* escape parser state */
 	char trantbl[4]; /* charset table translation */
 	int charset;  /* current charset */
 	int icharset; /* selected charset for sequence */
 	int *tabs;
 	Rune lastc;   /* last printed char outside of sequence, 0 if control */
+	StyleTable styles;
 } Term;
 
+/*
+ * Copy of the screen taken at a frame boundary, drawn without holding
+ * termlock while the tty thread keeps parsing into term.
+ */
+typedef struct {
+	int row;       /* nb row */
+	int col;       /* nb col */
+	Line *line;    /* copies of the dirty rows */
+	int *dirty;    /* rows copied for this frame */
+	Line oline;    /* copy of the row the old cursor is on */
+	int cx, cy;    /* cursor */
+	int ocx, ocy;  /* old cursor */
+	Glyph cg, og;  /* glyphs under the cursor and the old cursor */
+	Selection sel;
+	int alt;       /* altscreen was active */
+} Frame;
+
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [<priv>] [<arg> [;]] [<inter>] <mode> */
 typedef struct {
-	char buf[ESC_BUF_SIZ]; /* raw string */
+	char buf[ESC_BUF_SIZ]; /* raw string, without the final byte */
 	size_t len;            /* raw string length */
-	char priv;
+	char priv;             /* private marker, one of "<=>?" */
 	int arg[ESC_ARG_SIZ];
 	int narg;              /* nb of args */
-	char mode[2];
+	char inter;            /* intermediate byte */
+	char mode;             /* final byte */
 } CSIEscape;
 
 /* STR Escape sequence structs */
@@ -181,20 +428,62 @@ typedef struct {
 	int narg;              /* nb of args */
 } STREscape;
 
+/* bytes waiting for the tty to become writable */
+typedef struct {
+	char *buf;
+	size_t siz;
+	size_t len;   /* end of the queued bytes */
+	size_t off;   /* start of the queued bytes */
+} WriteQueue;
+
 static void execsh(char *, char **);
 static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
+static void ttyflush(void);
 
 static void csidump(void);
+static void csicollect(Rune);
+static int csiich(void);
+static int csicuu(void);
+static int csicud(void);
+static int csimc(void);
+static int csida(void);
+static int csirep(void);
+static int csicuf(void);
+static int csicub(void);
+static int csicnl(void);
+static int csicpl(void);
+static int csitbc(void);
+static int csicha(void);
+static int csicup(void);
+static int csicht(void);
+static int csied(void);
+static int csiel(void);
+static int csisu(void);
+static int csisd(void);
+static int csiil(void);
+static int csirm(void);
+static int csidl(void);
+static int csiech(void);
+static int csidch(void);
+static int csicbt(void);
+static int csivpa(void);
+static int csism(void);
+static int csisgr(void);
+static int csidsr(void);
+static int csistbm(void);
+static int csiscp(void);
+static int csircp(void);
+static int csiscusr(void);
 static void csihandle(void);
-static void csiparse(void);
 static void csireset(void);
 static void osc_color_response(int, int, int);
-static int eschandle(uchar);
+static void eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
+static void strput(Rune);
 static void strreset(void);
 
 static void tprinter(char *, size_t);
@@ -203,25 +492,97 @@ static void tdumpline(int);
 static void tdump(void);
 static void tclearregion(int, int, int, int, int);
 static void tcursor(int);
-static void tclearglyph(Glyph *, int);
+static void tclearglyph(Cell *, int);
+static void tcellmode(Cell *, int, int);
+static uint32_t tintern(ushort, uint32_t, uint32_t);
+static void trehash(uint32_t);
+static void tstylegc(void);
+static void tunpack(Glyph *, const Cell *, int);
+static void tunpackrow(Glyph *, const Cell *);
+static void thistgrow(int);
+static void thistpush(HistLine *, int);
+static HistLine *thistpop(void);
+static void thistrewrap(int);
+static void tsegadd(int, int);
+static void tsegdrop(int);
+static void tparapush(int);
+static void tparapop(void);
+static void tparadrop(void);
+static int tparafind(int);
+static int thiststart(int);
+static int thistend(int);
+static int thistwrapped(int);
+static int tlinestart(int);
+static int tlineend(int);
+static HistLine *thistpack(const Cell *, int);
+static HistLine *thistshare(const Cell *, int, Cell);
+static HistLine *thistnew(const Cell *, int, Cell);
+static int thistsame(const HistLine *, const Cell *, int, Cell);
+static size_t thistsize(const HistLine *);
+static void thistdrop(void);
+static void tbudget(void);
+static size_t tmemused(int);
+static void thistfree(HistLine *);
+static uint32_t thisthash(const Cell *, int, Cell);
+static void thistdedupflush(void);
+static void thistunpack(Cell *, const HistLine *, int);
+static const Cell *thistline(int);
+static const Cell *thistrow(int, int);
+static void thistflush(void);
+static HistLine *tcoldget(int);
+static void tcoldthaw(void);
+static void tcolddrop(void);
+static void tcoldclear(void);
+static void tcoldfree(ColdBlock *, int);
+static uchar *tspill(const uchar *, size_t);
+static Spill *tspillopen(void);
+static void tspillclose(int);
+static int tcoldpack(int);
+static void tcoldkick(void);
+static void tcoldstart(void);
+static void *tcoldloop(void *);
+static uchar *putvar(uchar *, uint32_t);
+static uint32_t getvar(const uchar **);
+static uchar *putstyle(uchar *, const Style *);
+static uint32_t getstyle(const uchar **);
+static void tsetline(int, Cell *);
+static void trotate(int);
+static void tmirror(void);
 static void tresetcursor(void);
 static void tdeletechar(int);
 static void tdeleteline(int);
 static void tinsertblank(int);
 static void tinsertblankline(int);
-static int tlinelen(Line len);
-static int tiswrapped(Line line);
-static char *tgetglyphs(char *, const Glyph *, const Glyph *);
-static size_t tgetline(char *, const Glyph *);
+static int tlinelen(const Cell *);
+static int trowlen(const Cell *, int);
+static int tlineattr(const Cell *, int);
+static void tlinewiden(Cell *, int, int);
+static Cell *tlinefill(Cell *, int);
+static void tlinetake(Cell *, int, int);
+static Cell *trowalloc(int);
+static Cell *trowrealloc(Cell *, int);
+static void trowcopy(Cell *, Cell *, int, int);
+static void tslabnew(Cell **, int, int);
+static void tslabdone(void);
+static void tregrid(int, int, int);
+static void trowfree(Cell *);
+static int tiswrapped(const Cell *);
+static int trowwrapped(const Cell *, int);
+static char *tgetglyphs(char *, const Cell *, const Cell *);
+static size_t tgetline(char *, const Cell *);
 static void tmoveto(int, int);
 static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputglyph(Rune);
+static void tputascii(const Rune *, int);
 static void treset(void);
 static void tscrollup(int, int, int, int);
 static void tscrolldown(int, int);
 static void treflow(int, int);
+static const Cell *treflowline(int, int *);
+static Cell **treflowlines(int, int, int, int *, int *);
 static void rscrolldown(int);
 static void tresizedef(int, int);
 static void tresizealt(int, int);
@@ -233,8 +594,7 @@ static void tswapscreen(void);
 static void tloaddefscreen(int, int);
 static void tloadaltscreen(int, int);
 static void tsetmode(int, int, const int *, int);
-static int twrite(const char *, int, int);
-static void tfulldirt(void);
+static int tasciilen(const Rune *, int);
 static void tcontrolcode(uchar );
 static void tdectest(char );
 static void tdefutf8(char);
@@ -243,15 +603,19 @@ static void tdeftran(char);
 static void tstrsequence(uchar);
 
 static void drawregion(int, int, int, int);
+static void tsnapshot(void);
 
 static void selnormalize(void);
 static void selscroll(int, int, int);
 static void selmove(int);
 static void selremove(void);
+static int selregion(const Selection *, int, int, int, int, int);
 static int regionselected(int, int, int, int);
 static void selsnap(int *, int *, int);
 
+static int runewidth(Rune);
 static size_t utf8decode(const char *, Rune *, size_t);
+static size_t utf8decodebuf(const char *, size_t, Rune *, size_t *);
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
@@ -261,6 +625,10 @@ static char base64dec_getc(const char **);
 
 static ssize_t xwrite(int, const char *, size_t);
 
+static void tlockinit(void);
+static void *ttyloop(void *);
+static void ttywake(void);
+
 /* Globals */
 static Term term;
 static Selection sel;
@@ -270,6 +638,21 @@ static int iofd = 1;
 static int cmdfd;
 static pid_t pid;
 
+/* term is shared between the tty thread and the main thread */
+static pthread_mutex_t termlock;
+static pthread_once_t termlockonce = PTHREAD_ONCE_INIT;
+static int termwaiting; /* threads blocked in tlock() */
+static pthread_mutex_t coldlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coldcond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t coldonce = PTHREAD_ONCE_INIT;
+static int coldwork;    /* guarded by coldlock */
+static int wakefd[2];   /* tty thread -> main thread */
+static int wakepending;
+static int kickfd[2] = {-1, -1}; /* -> tty thread, writes were queued */
+static int serialline;  /* cmdfd is a line given with -l, not a pty */
+static WriteQueue outq;
+static Frame frame;
+
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static const Rune utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
@@ -323,6 +706,17 @@ xstrdup(const char *s)
 	return p;
 }
 
+/*
+ * Width of a rune in cells from the generated table, the same on every
+ * host and independent of the locale. u must be a valid code point, as
+ * the UTF-8 decoders guarantee.
+ */
+int
+runewidth(Rune u)
+{
+	return widthtbl[widthidx[u >> 8]][u & 0xff];
+}
+
 size_t
 utf8decode(const char *c, Rune *u, size_t clen)
 {
@@ -348,6 +742,117 @@ utf8decode(const char *c, Rune *u, size_t clen)
 	return len;
 }
 
+/*
+ * Bulk version of utf8decode(): decodes the complete sequences at the
+ * start of c into at most *ulen runes, stores the number of runes in
+ * *ulen and returns the number of bytes used. Invalid sequences decode
+ * as in utf8decode(), an incomplete sequence at the end is left over.
+ *
+ * Blocks of UTF8_BLK bytes are classified with SIMD first: pure ASCII
+ * blocks are widened at once, the continuation bytes of the others are
+ * checked against a bit mask instead of one by one.
+ */
+size_t
+utf8decodebuf(const char *c, size_t clen, Rune *u, size_t *ulen)
+{
+	/* sequence length by lead byte >> 3, 0 when not a lead byte */
+	static const uchar seqlen[32] = {
+		1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+		0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 0
+	};
+	const uchar *s = (const uchar *)c;
+	size_t i = 0, n = 0, len, j, blk = 0, blkend = 0;
+	uint32_t cont = 0, mask;
+	Rune r;
+#if defined(UTF8_BLK) && defined(__AVX2__)
+	__m256i v;
+#elif defined(UTF8_BLK)
+	__m128i v, lo, hi;
+	const __m128i zero = _mm_setzero_si128();
+#endif
+
+	while (i < clen && n < *ulen) {
+#if defined(UTF8_BLK)
+		if (i + UTF_SIZ > blkend && clen - i >= UTF8_BLK) {
+#if defined(__AVX2__)
+			v = _mm256_loadu_si256((const __m256i *)(s + i));
+			if (!_mm256_movemask_epi8(v) && *ulen - n >= UTF8_BLK) {
+				for (j = 0; j < UTF8_BLK; j += 8) {
+					_mm256_storeu_si256((__m256i *)(u + n + j),
+						_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+						(const __m128i *)(s + i + j))));
+				}
+				i += UTF8_BLK;
+				n += UTF8_BLK;
+				continue;
+			}
+			/* signed compare: 0x80 - 0xbf are below -0x40 */
+			cont = _mm256_movemask_epi8(_mm256_cmpgt_epi8(
+				_mm256_set1_epi8(-0x40), v));
+#else
+			v = _mm_loadu_si128((const __m128i *)(s + i));
+			if (!_mm_movemask_epi8(v) && *ulen - n >= UTF8_BLK) {
+				lo = _mm_unpacklo_epi8(v, zero);
+				hi = _mm_unpackhi_epi8(v, zero);
+				_mm_storeu_si128((__m128i *)(u + n),
+				                 _mm_unpacklo_epi16(lo, zero));
+				_mm_storeu_si128((__m128i *)(u + n + 4),
+				                 _mm_unpackhi_epi16(lo, zero));
+				_mm_storeu_si128((__m128i *)(u + n + 8),
+				                 _mm_unpacklo_epi16(hi, zero));
+				_mm_storeu_si128((__m128i *)(u + n + 12),
+				                 _mm_unpackhi_epi16(hi, zero));
+				i += UTF8_BLK;
+				n += UTF8_BLK;
+				continue;
+			}
+			/* signed compare: 0x80 - 0xbf are below -0x40 */
+			cont = _mm_movemask_epi8(_mm_cmplt_epi8(v,
+				_mm_set1_epi8(-0x40)));
+#endif
+			blk = i;
+			blkend = i + UTF8_BLK;
+		}
+#endif
+		if (s[i] < 0x80) {
+			u[n++] = s[i++];
+			continue;
+		}
+
+		len = seqlen[s[i] >> 3];
+		if (len > 1 && i + len <= blkend) {
+			mask = (1 << (len - 1)) - 1;
+			if ((cont >> (i - blk + 1) & mask) != mask)
+				len = 0;
+		} else if (len > 1 && i + len <= clen) {
+			for (j = 1; j < len && (s[i + j] & 0xC0) == 0x80; j++)
+				;
+			if (j < len)
+				len = 0;
+		} else {
+			len = 0;
+		}
+
+		if (!len) {
+			/* invalid or incomplete, take the slow path */
+			if (!(len = utf8decode(c + i, &r, clen - i)))
+				break;
+		} else {
+			r = s[i] & (0x7F >> len);
+			for (j = 1; j < len; j++)
+				r = (r << 6) | (s[i + j] & 0x3F);
+			if (!BETWEEN(r, utfmin[len], utfmax[len]) ||
+			    BETWEEN(r, 0xD800, 0xDFFF))
+				r = UTF_INVALID;
+		}
+		u[n++] = r;
+		i += len;
+	}
+	*ulen = n;
+
+	return i;
+}
+
 Rune
 utf8decodebyte(char c, size_t *i)
 {
@@ -448,27 +953,182 @@ selinit(void)
 }
 
 int
-tlinelen(Line line)
+tlinelen(const Cell *line)
+{
+	return trowlen(line, term.col);
+}
+
+/* tlinelen() for a row of col cells, not necessarily term.col */
+int
+trowlen(const Cell *line, int col)
+{
+	LineMeta *m = LMETA(line);
+	int i = MIN(MIN(m->len, m->clr), col) - 1;
+
+	for (; i >= 0 && !(CMODE(line[i]) & (ATTR_SET | ATTR_WRAP)); i--);
+	return m->len = i + 1;
+}
+
+/* returns whether a cell of line has one of the ATTR_* in attr */
+int
+tlineattr(const Cell *line, int attr)
+{
+	LineMeta *m = LMETA(line);
+	int i, all = 0;
+
+	if (!(m->attr & attr) || !m->loose)
+		return m->attr & attr;
+	for (i = 0; i < MIN(m->clr, term.col); i++)
+		all |= CMODE(line[i]);
+	m->attr = all;
+	m->loose = 0;
+	return all & attr;
+}
+
+/* widens the bounds of line for a cell at x getting mode */
+void
+tlinewiden(Cell *line, int x, int mode)
+{
+	LineMeta *m = LMETA(line);
+
+	if ((mode & (ATTR_SET | ATTR_WRAP)) && m->len <= x)
+		m->len = x + 1;
+	m->attr |= mode;
+	m->loose = 1;
+}
+
+/* writes out the blanks pending in line before x, returns line */
+Cell *
+tlinefill(Cell *line, int x)
+{
+	LineMeta *m = LMETA(line);
+	Cell *c, *end;
+
+	if (m->clr >= x)
+		return line;
+	for (c = line + m->clr, end = line + x; c < end; c++)
+		*c = (Cell){ .u = ' ', .s = m->clrs };
+	m->clr = x;
+	return line;
+}
+
+/* cells x1 to x2 of line are about to be written without being read */
+void
+tlinetake(Cell *line, int x1, int x2)
+{
+	LineMeta *m = LMETA(line);
+
+	tlinefill(line, x1);
+	if (m->clr <= x2)
+		m->clr = x2 + 1;
+}
+
+/* rows out of the screen carry a LineMeta as well, which starts out loose */
+Cell *
+trowalloc(int col)
+{
+	return trowrealloc(NULL, col);
+}
+
+Cell *
+trowrealloc(Cell *line, int col)
+{
+	LineMeta *m = xrealloc(line ? LMETA(line) : NULL, ROWSIZE(col));
+
+	if (!line)
+		*m = (LineMeta){ .len = col, .attr = ~0, .clr = INT_MAX };
+	m->loose = 1;
+	return (Cell *)(m + 1);
+}
+
+void
+trowfree(Cell *line)
+{
+	free(LMETA(line));
+}
+
+/* copies a row of ocol cells to one of col, any new cells default blanks */
+void
+trowcopy(Cell *dst, Cell *src, int ocol, int col)
+{
+	if (col > ocol)
+		tlinefill(src, ocol);
+	memcpy(LMETA(dst), LMETA(src), ROWSIZE(MIN(ocol, col)));
+	if (col > ocol) {
+		LMETA(dst)->clr = ocol;
+		LMETA(dst)->clrs = 0;
+	}
+}
+
+/*
+ * Lays out row rows of col default blanks in the spare slab, one after
+ * the other, and points the first half of ring at them. A resize builds
+ * the new grid there, tslabdone() then keeps the old slab as the spare
+ * for the next one.
+ */
+void
+tslabnew(Cell **ring, int col, int row)
+{
+	size_t siz = row * ROWSIZE(col);
+	int i;
+
+	if (term.spare.siz < siz) {
+		free(term.spare.p);
+		term.spare.p = xmalloc(term.spare.siz = siz);
+	}
+	for (i = 0; i < row; i++) {
+		ring[i] = (Cell *)(term.spare.p + i * ROWSIZE(col) +
+		                   sizeof(LineMeta));
+		*LMETA(ring[i]) = (LineMeta){ 0 };
+	}
+}
+
+void
+tslabdone(void)
+{
+	Slab tmp = term.slab;
+
+	term.slab = term.spare;
+	term.spare = tmp;
+}
+
+/*
+ * Moves the screen from row top on to a new grid of row rows of col
+ * cells, cutting them or padding them with default blanks.
+ */
+void
+tregrid(int top, int col, int row)
 {
-	int i = term.col - 1;
+	Cell **ring = xmalloc(2 * row * sizeof(Cell *));
+	int i;
+
+	tslabnew(ring, col, row);
+	for (i = 0; i < row && top + i < term.row; i++)
+		trowcopy(ring[i], term.line[top + i], term.col, col);
+	free(term.ring);
+	term.line = term.ring = ring;
+	tslabdone();
+}
 
-	for (; i >= 0 && !(line[i].mode & (ATTR_SET | ATTR_WRAP)); i--);
-	return i + 1;
+int
+tiswrapped(const Cell *line)
+{
+	return trowwrapped(line, term.col);
 }
 
 int
-tiswrapped(Line line)
+trowwrapped(const Cell *line, int col)
 {
-	int len = tlinelen(line);
+	int len = trowlen(line, col);
 
-	return len > 0 && (line[len - 1].mode & ATTR_WRAP);
+	return len > 0 && (CMODE(line[len - 1]) & ATTR_WRAP);
 }
 
 char *
-tgetglyphs(char *buf, const Glyph *gp, const Glyph *lgp)
+tgetglyphs(char *buf, const Cell *gp, const Cell *lgp)
 {
 	while (gp <= lgp)
-		if (gp->mode & ATTR_WDUMMY) {
+		if (CMODE(*gp) & ATTR_WDUMMY) {
 			gp++;
 		} else {
 			buf += utf8encode((gp++)->u, buf);
@@ -477,15 +1137,15 @@ tgetglyphs(char *buf, const Glyph *gp, const Glyph *lgp)
 }
 
 size_t
-tgetline(char *buf, const Glyph *fgp)
+tgetline(char *buf, const Cell *fgp)
 {
 	char *ptr;
-	const Glyph *lgp = &fgp[term.col - 1];
+	const Cell *lgp = &fgp[term.col - 1];
 
-	while (lgp > fgp && !(lgp->mode & (ATTR_SET | ATTR_WRAP)))
+	while (lgp > fgp && !(CMODE(*lgp) & (ATTR_SET | ATTR_WRAP)))
 		lgp--;
 	ptr = tgetglyphs(buf, fgp, lgp);
-	if (!(lgp->mode & ATTR_WRAP))
+	if (!(CMODE(*lgp) & ATTR_WRAP))
 		*(ptr++) = '\n';
 	return ptr - buf;
 }
@@ -495,10 +1155,10 @@ tlinehistlen(int y)
 {
 	int i = term.col;
 
-	if (TLINE_HIST(y)[i - 1].mode & ATTR_WRAP)
+	if (CMODE(TLINEABS(y)[i - 1]) & ATTR_WRAP)
 		return i;
 
-	while (i > 0 && TLINE_HIST(y)[i - 1].u == ' ')
+	while (i > 0 && TLINEABS(y)[i - 1].u == ' ')
 		--i;
 
 	return i;
@@ -581,21 +1241,31 @@ selnormalize(void)
 }
 
 int
-regionselected(int x1, int y1, int x2, int y2)
+selregion(const Selection *s, int alt, int x1, int y1, int x2, int y2)
 {
-	if (sel.ob.x == -1 || sel.mode == SEL_EMPTY ||
-	    sel.alt != IS_SET(MODE_ALTSCREEN) || sel.nb.y > y2 || sel.ne.y < y1)
+	if (s->ob.x == -1 || s->mode == SEL_EMPTY ||
+	    s->alt != alt || s->nb.y > y2 || s->ne.y < y1)
 		return 0;
 
-	return (sel.type == SEL_RECTANGULAR) ? sel.nb.x <= x2 && sel.ne.x >= x1
-		: (sel.nb.y != y2 || sel.nb.x <= x2) &&
-		  (sel.ne.y != y1 || sel.ne.x >= x1);
+	return (s->type == SEL_RECTANGULAR) ? s->nb.x <= x2 && s->ne.x >= x1
+		: (s->nb.y != y2 || s->nb.x <= x2) &&
+		  (s->ne.y != y1 || s->ne.x >= x1);
+}
+
+int
+regionselected(int x1, int y1, int x2, int y2)
+{
+	return selregion(&sel, IS_SET(MODE_ALTSCREEN), x1, y1, x2, y2);
 }
 
+/*
+ * For the drawing side: tests the selection as it was when the frame
+ * being drawn was taken.
+ */
 int
 selected(int x, int y)
 {
-	return regionselected(x, y, x, y);
+	return selregion(&frame.sel, frame.alt, x, y, x, y);
 }
 
 void
@@ -604,7 +1274,7 @@ selsnap(int *x, int *y, int direction)
 	int newx, newy, xt, yt;
 	int rtop = 0, rbot = term.row - 1;
 	int delim, prevdelim;
-	const Glyph *gp, *prevgp;
+	const Cell *gp, *prevgp;
 
 	if (!IS_SET(MODE_ALTSCREEN))
 		rtop += -term.histf + term.scr, rbot += term.scr;
@@ -630,7 +1300,7 @@ selsnap(int *x, int *y, int direction)
 					yt = *y, xt = *x;
 				else
 					yt = newy, xt = newx;
-				if (!(TLINE(yt)[xt].mode & ATTR_WRAP))
+				if (!(CMODE(TLINE(yt)[xt]) & ATTR_WRAP))
 					break;
 			}
 
@@ -639,7 +1309,7 @@ selsnap(int *x, int *y, int direction)
 
 			gp = &TLINE(newy)[newx];
 			delim = ISDELIM(gp->u);
-			if (!(gp->mode & ATTR_WDUMMY) && (delim != prevdelim ||
+			if (!(CMODE(*gp) & ATTR_WDUMMY) && (delim != prevdelim ||
 			    (delim && !(gp->u == ' ' && prevgp->u == ' '))))
 				break;
 
@@ -656,16 +1326,22 @@ selsnap(int *x, int *y, int direction)
 		 * previous line will be selected.
 		 */
 		*x = (direction < 0) ? 0 : term.col - 1;
-		if (direction < 0) {
-			for (; *y > rtop; *y -= 1) {
-				if (!tiswrapped(TLINE(*y-1)))
-					break;
+		if (IS_SET(MODE_ALTSCREEN)) {
+			if (direction < 0) {
+				for (; *y > rtop; *y -= 1) {
+					if (!tiswrapped(TLINE(*y-1)))
+						break;
+				}
+			} else if (direction > 0) {
+				for (; *y < rbot; *y += 1) {
+					if (!tiswrapped(TLINE(*y)))
+						break;
+				}
 			}
+		} else if (direction < 0) {
+			*y = tlinestart(*y - term.scr) + term.scr;
 		} else if (direction > 0) {
-			for (; *y < rbot; *y += 1) {
-				if (!tiswrapped(TLINE(*y)))
-					break;
-			}
+			*y = tlineend(*y - term.scr) + term.scr;
 		}
 		break;
 	}
@@ -676,7 +1352,7 @@ getsel(void)
 {
 	char *str, *ptr;
 	int y, lastx, linelen;
-	const Glyph *gp, *lgp;
+	const Cell *gp, *lgp;
 
 	if (sel.ob.x == -1 || sel.alt != IS_SET(MODE_ALTSCREEN))
 		return NULL;
@@ -686,7 +1362,7 @@ getsel(void)
 
 	/* append every set & selected glyph to the selection */
 	for (y = sel.nb.y; y <= sel.ne.y; y++) {
-		Line line = TLINE(y);
+		const Cell *line = TLINE(y);
 
 		if ((linelen = tlinelen(line)) == 0) {
 			*ptr++ = '\n';
@@ -713,7 +1389,7 @@ getsel(void)
 		 * FIXME: Fix the computer world.
 		 */
 		if ((y < sel.ne.y || lastx >= linelen) &&
-		    (!(lgp->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
+		    (!(CMODE(*lgp) & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
 			*ptr++ = '\n';
 	}
 	*ptr = '\0';
@@ -869,6 +1545,8 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 			    line, strerror(errno));
 		dup2(cmdfd, 0);
 		stty(args);
+		serialline = 1;
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		return cmdfd;
 	}
 
@@ -904,36 +1582,176 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 #endif
 		close(s);
 		cmdfd = m;
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		signal(SIGCHLD, sigchld);
 		break;
 	}
 	return cmdfd;
 }
 
+/*
+ * Drains the tty until it would block or ttyreadmax bytes were read and
+ * returns the number of bytes read. The buffer grows, up to TTY_BUF_MAX,
+ * while reads keep filling it.
+ */
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	int ret, written;
+	static char *buf;
+	static size_t bufsiz, buflen;
+	size_t total = 0;
+	ssize_t ret;
+	int written;
 
-	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	if (!buf)
+		buf = xmalloc(bufsiz = BUFSIZ);
 
-	switch (ret) {
-	case 0:
-		exit(0);
-	case -1:
-		die("couldn't read from shell: %s\n", strerror(errno));
-	default:
+	while (!ttyreadmax || total < ttyreadmax) {
+		/* append read bytes to unprocessed bytes */
+		ret = read(cmdfd, buf+buflen, bufsiz-buflen);
+
+		switch (ret) {
+		case 0:
+			exit(0);
+		case -1:
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return total;
+			die("couldn't read from shell: %s\n", strerror(errno));
+		}
+
+		total += ret;
 		buflen += ret;
 		written = twrite(buf, buflen, 0);
 		buflen -= written;
 		/* keep any incomplete UTF-8 byte sequence for the next call */
 		if (buflen > 0)
 			memmove(buf, buf + written, buflen);
-		return ret;
+
+		/* a full read means more is waiting, read bigger chunks */
+		if (buflen + written == bufsiz && bufsiz < TTY_BUF_MAX)
+			buf = xrealloc(buf, bufsiz *= 2);
+	}
+	return total;
+}
+
+void
+tlockinit(void)
+{
+	pthread_mutexattr_t attr;
+
+	/* recursive: handlers running under tlock() may redraw() */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&termlock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void
+tlock(void)
+{
+	pthread_once(&termlockonce, tlockinit);
+	__atomic_add_fetch(&termwaiting, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&termlock);
+	__atomic_sub_fetch(&termwaiting, 1, __ATOMIC_ACQ_REL);
+}
+
+void
+tunlock(void)
+{
+	pthread_mutex_unlock(&termlock);
+}
+
+/*
+ * Reads and parses the tty. term belongs to this thread while it holds
+ * termlock; the main thread only takes it to handle X events and to copy
+ * out a frame.
+ */
+void *
+ttyloop(void *unused)
+{
+	struct pollfd pfd[2] = {
+		{.fd = cmdfd, .events = POLLIN},
+		{.fd = kickfd[0], .events = POLLIN},
+	};
+	char buf[64];
+	size_t n = 0;
+
+	for (;;) {
+		tlock();
+		pfd[0].events = POLLIN | (outq.len ? POLLOUT : 0);
+		tunlock();
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll failed: %s\n", strerror(errno));
+		}
+
+		tlock();
+		if (pfd[1].revents & POLLIN) {
+			while (read(kickfd[0], buf, sizeof(buf)) > 0)
+				;
+		}
+		if (pfd[0].revents & POLLOUT)
+			ttyflush();
+		if (pfd[0].revents & ~POLLOUT)
+			n = ttyread();
+		tunlock();
+		if (n > 0)
+			ttywake();
+		n = 0;
+
+		/* do not take term back while the main thread waits for it */
+		while (__atomic_load_n(&termwaiting, __ATOMIC_ACQUIRE) > 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+void
+ttywake(void)
+{
+	/* one pending byte is enough, the main thread drains the pipe */
+	if (!__atomic_exchange_n(&wakepending, 1, __ATOMIC_ACQ_REL))
+		xwrite(wakefd[1], "", 1);
+}
+
+/*
+ * Starts the tty thread and returns a descriptor that becomes readable
+ * when it has parsed new content. Call ttyclearwake() once it is.
+ */
+int
+ttythread(void)
+{
+	pthread_t thread;
+	int i;
+
+	if (pipe(wakefd) < 0 || pipe(kickfd) < 0)
+		die("pipe failed: %s\n", strerror(errno));
+	for (i = 0; i < 2; i++) {
+		fcntl(wakefd[i], F_SETFL, fcntl(wakefd[i], F_GETFL) | O_NONBLOCK);
+		fcntl(kickfd[i], F_SETFL, fcntl(kickfd[i], F_GETFL) | O_NONBLOCK);
 	}
+
+	pthread_once(&termlockonce, tlockinit);
+	if ((errno = pthread_create(&thread, NULL, ttyloop, NULL)))
+		die("pthread_create failed: %s\n", strerror(errno));
+	pthread_detach(thread);
+
+	return wakefd[0];
+}
+
+void
+ttyclearwake(void)
+{
+	char buf[64];
+
+	/* drain before clearing, so a wakeup is never lost in between */
+	while (read(wakefd[0], buf, sizeof(buf)) > 0)
+		;
+	__atomic_store_n(&wakepending, 0, __ATOMIC_RELEASE);
 }
 
 void
@@ -965,61 +1783,70 @@ ttywrite(const char *s, size_t n, int may_echo)
 	}
 }
 
+/*
+ * Queues s and writes as much of the queue as the tty takes without
+ * blocking. The tty thread writes the rest once cmdfd is writable, so
+ * large pastes never stall drawing or parsing.
+ */
 void
 ttywriteraw(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
-	ssize_t r;
-	size_t lim = 256;
+	int queued = outq.len > 0;
+
+	if (outq.len + n > outq.siz) {
+		/* drop what was written before growing */
+		if (outq.off > 0) {
+			memmove(outq.buf, outq.buf + outq.off, outq.len - outq.off);
+			outq.len -= outq.off;
+			outq.off = 0;
+		}
+		if (outq.len + n > outq.siz)
+			outq.buf = xrealloc(outq.buf,
+			                    outq.siz = MAX(2 * outq.siz, outq.len + n));
+	}
+	memcpy(outq.buf + outq.len, s, n);
+	outq.len += n;
+
+	if (!queued)
+		ttyflush();
+	/* the tty thread has to poll for POLLOUT from now on */
+	if (!queued && outq.len > 0 && kickfd[1] >= 0)
+		xwrite(kickfd[1], "", 1);
+}
 
-	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
-	 * dance.
-	 * FIXME: Migrate the world to Plan 9.
-	 */
-	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
+void
+ttyflush(void)
+{
+	ssize_t r;
+	size_t n;
 
-		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+	while (outq.off < outq.len) {
+		/*
+		 * A line given with -l might be a modem line, writing too much
+		 * at once would clog it: 256 bytes each time it is writable.
+		 */
+		n = outq.len - outq.off;
+		if ((r = write(cmdfd, outq.buf + outq.off, serialline ? MIN(n, 256) : n)) < 0) {
 			if (errno == EINTR)
 				continue;
-			die("select failed: %s\n", strerror(errno));
-		}
-		if (FD_ISSET(cmdfd, &wfd)) {
-			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
-			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
-			if (r < n) {
-				/*
-				 * We weren't able to write out everything.
-				 * This means the buffer is getting full
-				 * again. Empty it.
-				 */
-				if (n < lim)
-					lim = ttyread();
-				n -= r;
-				s += r;
-			} else {
-				/* All bytes have been written. */
-				break;
-			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			die("write error on tty: %s\n", strerror(errno));
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
+		outq.off += r;
+		if (serialline)
+			break;
 	}
-	return;
+	if (outq.off < outq.len)
+		return;
 
-write_error:
-	die("write error on tty: %s\n", strerror(errno));
+	outq.off = outq.len = 0;
+	/* do not keep a large paste around */
+	if (outq.siz > BUFSIZ) {
+		free(outq.buf);
+		outq.buf = NULL;
+		outq.siz = 0;
+	}
 }
 
 void
@@ -1045,11 +1872,14 @@ ttyhangup(void)
 int
 tattrset(int attr)
 {
-	int i, j;
+	int i, j, n;
 
 	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
+		if (!tlineattr(term.line[i], attr))
+			continue;
+		n = MIN(term.col-1, LMETA(term.line[i])->clr);
+		for (j = 0; j < n; j++) {
+			if (CMODE(term.line[i][j]) & attr)
 				return 1;
 		}
 	}
@@ -1072,11 +1902,14 @@ tsetdirt(int top, int bot)
 void
 tsetdirtattr(int attr)
 {
-	int i, j;
+	int i, j, n;
 
 	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
+		if (!tlineattr(term.line[i], attr))
+			continue;
+		n = MIN(term.col-1, LMETA(term.line[i])->clr);
+		for (j = 0; j < n; j++) {
+			if (CMODE(term.line[i][j]) & attr) {
 				term.dirty[i] = 1;
 				break;
 			}
@@ -1116,7 +1949,7 @@ void
 treset(void)
 {
 	uint i;
-  int x, y;
+  int y;
 
 	tresetcursor();
 
@@ -1124,7 +1957,10 @@ treset(void)
 	for (i = tabspaces; i < term.col; i += tabspaces)
 		term.tabs[i] = 1;
 	term.top = 0;
-	term.histf = 0;
+	term.histf = term.histh = 0;
+	tcoldclear();
+	term.histr = term.segn = 0;
+	term.para.n = term.para.wrap = 0;
 	term.scr = 0;
 	term.bot = term.row - 1;
 	term.mode = MODE_WRAP|MODE_UTF8;
@@ -1135,8 +1971,7 @@ treset(void)
 	for (i = 0; i < 2; i++) {
   	tcursor(CURSOR_SAVE); /* reset saved cursor */
 		for (y = 0; y < term.row; y++)
-			for (x = 0; x < term.col; x++)
-				tclearglyph(&term.line[y][x], 0);
+			*LMETA(term.line[y]) = (LineMeta){ 0 };
 		tswapscreen();
 	}
   tfulldirt();
@@ -1145,19 +1980,26 @@ treset(void)
 void
 tnew(int col, int row)
 {
-	int i, j;
+	int i;
+
+	term.styles.s = xmalloc((term.styles.siz = 256) * sizeof(Style));
+	term.styles.gc = STYLE_GC_MIN;
+	trehash(512);
+	tintern(ATTR_NULL, defaultfg, defaultbg);
 
 	for (i = 0; i < 2; i++) {
-		term.line = xmalloc(row * sizeof(Line));
-		for (j = 0; j < row; j++)
-			term.line[j] = xmalloc(col * sizeof(Glyph));
+		term.line = term.ring = xmalloc(2 * row * sizeof(Cell *));
+		tslabnew(term.ring, col, row);
+		tslabdone();
 		term.col = col, term.row = row;
+		tmirror();
 		tswapscreen();
 	}
 	term.dirty = xmalloc(row * sizeof(*term.dirty));
 	term.tabs = xmalloc(col * sizeof(*term.tabs));
-	for (i = 0; i < HISTSIZE; i++)
-		term.hist[i] = xmalloc(col * sizeof(Glyph));
+	histsize = MIN(histsize, HISTMAX);
+	histhot = MIN(histhot, HISTMAX);
+	thistflush();
   treset();
 }
 
@@ -1165,15 +2007,15 @@ tnew(int col, int row)
 void
 tswapscreen(void)
 {
-	static Line *altline;
-	static int altcol, altrow;
-	Line *tmpline = term.line;
+	Cell **tmpline = term.line, **tmpring = term.ring;
 	int tmpcol = term.col, tmprow = term.row;
+	Slab tmpslab = term.slab;
 
-	term.line = altline;
-	term.col = altcol, term.row = altrow;
-	altline = tmpline;
-	altcol = tmpcol, altrow = tmprow;
+	term.line = term.altline, term.ring = term.altring;
+	term.col = term.altcol, term.row = term.altrow;
+	term.altline = tmpline, term.altring = tmpring;
+	term.altcol = tmpcol, term.altrow = tmprow;
+	term.slab = term.altslab, term.altslab = tmpslab;
 	term.mode ^= MODE_ALTSCREEN;
 }
 
@@ -1251,6 +2093,7 @@ kscrollup(const Arg* a)
 	if (n < 0)
 		n = MAX(term.row / -n, 1);
 
+	thistrewrap(term.scr + n);
 	if (term.scr + n <= term.histf) {
 		term.scr += n;
 	} else {
@@ -1268,7 +2111,7 @@ void
 tscrolldown(int top, int n)
 {
 	int i, bot = term.bot;
-	Line temp;
+	Cell *temp;
 
 	if (n <= 0)
 		return;
@@ -1277,10 +2120,14 @@ tscrolldown(int top, int n)
 	tsetdirt(top, bot-n);
 	tclearregion(0, bot-n+1, term.col-1, bot, 1);
 
-	for (i = bot; i >= top+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+	if (top == 0 && bot == term.row-1) {
+		trotate(-n);
+	} else {
+		for (i = bot; i >= top+n; i--) {
+			temp = term.line[i];
+			tsetline(i, term.line[i-n]);
+			tsetline(i-n, temp);
+		}
 	}
 
 	if (sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN))
@@ -1292,27 +2139,27 @@ tscrollup(int top, int bot, int n, int mode)
 {
 	int i, j, s;
 	int alt = IS_SET(MODE_ALTSCREEN);
-	int savehist = !alt && top == 0 && mode != SCROLL_NOSAVEHIST;
-	Line temp;
+	int savehist = !alt && top == 0 && mode != SCROLL_NOSAVEHIST && histsize;
+	Cell *temp, blank;
 
 	if (n <= 0)
 		return;
 	n = MIN(n, bot-top+1);
 
 	if (savehist) {
+		tclearglyph(&blank, 1);
+		thistflush();
 		for (i = 0; i < n; i++) {
-			term.histi = (term.histi + 1) % HISTSIZE;
-			temp = term.hist[term.histi];
-			for (j = 0; j < term.col; j++)
-				tclearglyph(&temp[j], 1);
-			term.hist[term.histi] = term.line[i];
-			term.line[i] = temp;
+			thistpush(thistpack(term.line[i], term.col),
+			          tiswrapped(term.line[i]));
+			*LMETA(term.line[i]) = (LineMeta){ .clrs = blank.s };
 		}
-		term.histf = MIN(term.histf + n, HISTSIZE);
+		tcoldkick();
+		tbudget();
 		s = n;
 		if (term.scr) {
 			j = term.scr;
-			term.scr = MIN(j + n, HISTSIZE);
+			term.scr = MIN(j + n, term.histf);
 			s = j + n - term.scr;
 		}
 		if (mode != SCROLL_RESIZE)
@@ -1322,11 +2169,14 @@ tscrollup(int top, int bot, int n, int mode)
 		tsetdirt(top+n, bot);
 	}
 
-
-	for (i = top; i <= bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+	if (top == 0 && bot == term.row-1) {
+		trotate(n);
+	} else {
+		for (i = top; i <= bot-n; i++) {
+			temp = term.line[i];
+			tsetline(i, term.line[i+n]);
+			tsetline(i+n, temp);
+		}
 	}
 
 	if (sel.ob.x != -1 && sel.alt == alt) {
@@ -1340,6 +2190,977 @@ tscrollup(int top, int bot, int n, int mode)
 	}
 }
 
+/*
+ * Makes room for at least need lines in hist, oldest line first. Lines
+ * are only allocated when they scroll into a slot.
+ */
+void
+thistgrow(int need)
+{
+	HistLine **hist;
+	int n = MIN(MAX(MAX(2 * term.histn, HISTGROW), need), histsize), i;
+
+	hist = xmalloc(n * sizeof(HistLine *));
+	for (i = 0; i < term.histh; i++) {
+		hist[i] = term.hist[(term.histi - term.histh + 1 + i +
+		                     term.histn) % term.histn];
+	}
+	/* slots out of use still hold lines left by treset() */
+	for (; i < term.histn; i++)
+		thistfree(term.hist[(term.histi + 1 + i - term.histh) % term.histn]);
+	memset(hist + term.histh, 0, (n - term.histh) * sizeof(HistLine *));
+	free(term.hist);
+	term.hist = hist;
+	term.histi = term.histh - 1;
+	term.histn = n;
+	thistflush();
+}
+
+/*
+ * Adds h as the newest line of history, dropping the oldest if full.
+ * wrap is whether the row it was packed from goes on in the next one.
+ */
+void
+thistpush(HistLine *h, int wrap)
+{
+	if (!histsize) {
+		thistfree(h);
+		return;
+	}
+	if (term.histf == histsize) {
+		if (term.histc > 0)
+			tcolddrop();
+		else
+			thistdrop();
+	}
+	if (term.histh == term.histn)
+		thistgrow(term.histn + 1);
+	term.histi = (term.histi + 1) % term.histn;
+	thistfree(term.hist[term.histi]);
+	term.hist[term.histi] = h;
+	term.histh++;
+	term.histf++;
+	term.histr++;
+	tparapush(wrap);
+}
+
+/* takes the newest line off history, which has to be in hist */
+HistLine *
+thistpop(void)
+{
+	HistLine *h = term.hist[term.histi];
+
+	term.hist[term.histi] = NULL;
+	term.histi = (term.histi - 1 + term.histn) % term.histn;
+	term.histh--;
+	term.histf--;
+	tparapop();
+	if (term.histr > 0)
+		term.histr--;
+	else if (--term.seg[0].n == 0)
+		memmove(term.seg, term.seg + 1, --term.segn * sizeof(HistSeg));
+	return h;
+}
+
+/*
+ * Wraps history at the width of the screen until its newest need lines
+ * are, a few logical lines at a time. The lines taken grow with the
+ * ones done, so reading through the whole history costs about as much
+ * as a reflow of it.
+ */
+void
+thistrewrap(int need)
+{
+	HistLine **keep;
+	Cell **buf;
+	int k, n, m, i, age, end, cy = -1;
+	char *wrap;
+
+	if (term.histr >= (need = MIN(need, term.histf)))
+		return;
+	while (term.histr < need && term.segn > 0) {
+		k = term.histr;
+		end = k + term.seg[0].n;
+		age = MIN(k + MAX(MAX(need - k, term.row), k), end);
+		/* the older lines of the logical line at age go along */
+		age = MIN(thiststart(age), end);
+		n = age - k;
+		buf = treflowlines(-age, -k - 1, term.col, &m, &cy);
+
+		while (term.histh < age)
+			tcoldthaw();
+		keep = xmalloc(MAX(k, 1) * sizeof(*keep));
+		wrap = xmalloc(MAX(k, 1));
+		for (i = k - 1; i >= 0; i--) {
+			wrap[i] = term.para.wrap;
+			keep[i] = thistpop();
+		}
+		for (i = 0; i < n; i++)
+			thistfree(thistpop());
+		for (i = 0; i < m; i++) {
+			thistpush(thistpack(buf[i], term.col),
+			          trowwrapped(buf[i], term.col));
+			trowfree(buf[i]);
+		}
+		for (i = 0; i < k; i++)
+			thistpush(keep[i], wrap[i]);
+		free(keep);
+		free(wrap);
+		free(buf);
+		thistflush();
+	}
+	tcoldkick();
+	tbudget();
+}
+
+/* indexes a row entering history, see ParaIndex */
+void
+tparapush(int wrap)
+{
+	ParaIndex *p = &term.para;
+	uint32_t *id;
+	int i;
+
+	p->seq++;
+	if (!p->wrap) {
+		if (p->n == p->siz) {
+			id = xmalloc(MAX(2 * p->siz, HISTGROW) * sizeof(*id));
+			for (i = 0; i < p->n; i++)
+				id[i] = p->id[(p->i + i) % p->siz];
+			free(p->id);
+			p->id = id;
+			p->i = 0;
+			p->siz = MAX(2 * p->siz, HISTGROW);
+		}
+		p->id[(p->i + p->n++) % p->siz] = p->seq;
+	}
+	p->wrap = wrap;
+}
+
+/* forgets the newest row of history */
+void
+tparapop(void)
+{
+	ParaIndex *p = &term.para;
+	int start = p->n > 0 && p->id[(p->i + p->n - 1) % p->siz] == p->seq;
+
+	p->n -= start;
+	p->wrap = !start;
+	p->seq--;
+}
+
+/* forgets the starts older than the oldest row, once it is dropped */
+void
+tparadrop(void)
+{
+	ParaIndex *p = &term.para;
+
+	if (p->n > 0 && (int32_t)(p->id[p->i] - (p->seq - term.histf)) <= 0) {
+		p->i = (p->i + 1) % p->siz;
+		p->n--;
+	}
+}
+
+/* returns the newest start at or before the row age lines up, -1 if none */
+int
+tparafind(int age)
+{
+	ParaIndex *p = &term.para;
+	uint32_t oldest = p->seq - term.histf + 1, id = p->seq - age + 1;
+	int lo = 0, hi = p->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->id[(p->i + mid) % p->siz] - oldest <= id - oldest)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* returns the age of the first row of the logical line of row age */
+int
+thiststart(int age)
+{
+	int k = tparafind(age);
+
+	if (k < 0)
+		return term.histf;
+	return term.para.seq - term.para.id[(term.para.i + k) % term.para.siz] + 1;
+}
+
+/* returns the age of the last row in history of the logical line of row age */
+int
+thistend(int age)
+{
+	int k = tparafind(age) + 1;
+
+	if (k >= term.para.n)
+		return 1;
+	return term.para.seq - term.para.id[(term.para.i + k) % term.para.siz] + 2;
+}
+
+/* returns whether the row of history age lines up goes on in the next one */
+int
+thistwrapped(int age)
+{
+	return age == 1 ? term.para.wrap : thiststart(age - 1) != age - 1;
+}
+
+/* returns the first row of the logical line of row y, negative in history */
+int
+tlinestart(int y)
+{
+	while (y > 0 && tiswrapped(term.line[y - 1]))
+		y--;
+	if (y == 0 && term.histf > 0 && term.para.wrap)
+		y = -1;
+	return y < 0 ? -thiststart(-y) : y;
+}
+
+/* returns the last row of the logical line of row y */
+int
+tlineend(int y)
+{
+	if (y < 0) {
+		y = -thistend(-y);
+		if (y < -1 || !term.para.wrap)
+			return y;
+		y = 0;
+	}
+	while (y < term.row - 1 && tiswrapped(term.line[y]))
+		y++;
+	return y;
+}
+
+/* adds n lines wrapped at col in front of the older widths */
+void
+tsegadd(int n, int col)
+{
+	if (n <= 0)
+		return;
+	if (term.segn > 0 && term.seg[0].col == col) {
+		term.seg[0].n += n;
+		return;
+	}
+	term.seg = xrealloc(term.seg, ++term.segn * sizeof(HistSeg));
+	memmove(term.seg + 1, term.seg, (term.segn - 1) * sizeof(HistSeg));
+	term.seg[0] = (HistSeg){ .n = n, .col = col };
+}
+
+/* forgets the widths of the oldest n lines of history */
+void
+tsegdrop(int n)
+{
+	HistSeg *s;
+	int k;
+
+	for (; n > 0 && term.segn > 0; n -= k) {
+		s = &term.seg[term.segn - 1];
+		k = MIN(n, s->n);
+		if ((s->n -= k) == 0)
+			term.segn--;
+	}
+	term.histr -= n;
+}
+
+/* copies a row of col cells into a new history line */
+HistLine *
+thistpack(const Cell *line, int col)
+{
+	int len = MIN(LMETA(line)->clr, col);
+	Cell fill;
+
+	/* a blank tail is the fill as it is */
+	fill = len < col ? (Cell){ .u = ' ', .s = LMETA(line)->clrs }
+	                 : line[col - 1];
+	while (len > 0 && line[len - 1].u == fill.u && line[len - 1].s == fill.s)
+		len--;
+	return thistshare(line, len, fill);
+}
+
+/*
+ * Returns a line of history with this content, the copy of a recently
+ * stored line if there is one. Blank lines, spinners and repeated log
+ * lines then cost a pointer each.
+ */
+HistLine *
+thistshare(const Cell *c, int len, Cell fill)
+{
+	uint32_t hash = thisthash(c, len, fill);
+	Dedup *d = &term.dedup[hash & (DEDUPSIZ - 1)];
+	HistLine *h = d->h;
+
+	if (h && d->hash == hash && thistsame(h, c, len, fill)) {
+		h->ref++;
+		return h;
+	}
+
+	h = thistnew(c, len, fill);
+	h->ref = 2;
+	thistfree(d->h);
+	d->hash = hash;
+	d->h = h;
+	return h;
+}
+
+HistLine *
+thistnew(const Cell *c, int len, Cell fill)
+{
+	HistLine *h;
+	StyleRun *r;
+	uchar *t;
+	int i, runs = 0;
+
+	for (i = 0; i < len && c[i].u < 0x80; i++)
+		runs += i == 0 || c[i].s != c[i - 1].s;
+	if (i < len || runs * sizeof(StyleRun) + len >= len * sizeof(Cell)) {
+		h = xmalloc(sizeof(*h) + len * sizeof(Cell));
+		h->runs = 0;
+		memcpy(h->c, c, len * sizeof(Cell));
+	} else {
+		h = xmalloc(sizeof(*h) + runs * sizeof(StyleRun) + len);
+		h->runs = runs;
+		r = HRUN(h), t = HTEXT(h);
+		for (i = 0; i < len; i++) {
+			if (i > 0 && c[i].s != c[i - 1].s)
+				r++;
+			r->end = i + 1;
+			r->s = c[i].s;
+			t[i] = c[i].u;
+		}
+	}
+	h->len = len;
+	h->fill = fill;
+	term.histmem += thistsize(h);
+	return h;
+}
+
+/* returns whether h stores these cells */
+int
+thistsame(const HistLine *h, const Cell *c, int len, Cell fill)
+{
+	const StyleRun *r;
+	const uchar *t;
+	int i;
+
+	if (h->len != len || h->fill.u != fill.u || h->fill.s != fill.s)
+		return 0;
+	if (!h->runs)
+		return !memcmp(h->c, c, len * sizeof(Cell));
+	for (i = 0, r = HRUN(h), t = HTEXT(h); i < len; r++) {
+		for (; i < r->end; i++) {
+			if (c[i].u != t[i] || c[i].s != r->s)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+void
+thistfree(HistLine *h)
+{
+	if (h && --h->ref == 0) {
+		term.histmem -= thistsize(h);
+		free(h);
+	}
+}
+
+size_t
+thistsize(const HistLine *h)
+{
+	if (h->runs)
+		return sizeof(*h) + h->runs * sizeof(StyleRun) + h->len;
+	return sizeof(*h) + h->len * sizeof(Cell);
+}
+
+/* drops the oldest line of hist, once the cold ones are gone */
+void
+thistdrop(void)
+{
+	int i = (term.histi - term.histh + 1 + term.histn) % term.histn;
+
+	thistfree(term.hist[i]);
+	term.hist[i] = NULL;
+	term.histh--;
+	term.histf--;
+	tsegdrop(1);
+	tparadrop();
+	thistflush();
+}
+
+/*
+ * Drops history, oldest first, until the buffers of the terminal fit in
+ * membudget. Hot lines past the first block are compressed before any
+ * line is dropped, as that is often enough.
+ */
+void
+tbudget(void)
+{
+	size_t budget = (size_t)membudget << 10;
+
+	if (!membudget)
+		return;
+	while (tmemused(0) > budget) {
+		if (tcoldpack(HISTBLOCK))
+			continue;
+		if (term.histc > 0)
+			tcolddrop();
+		else if (term.histh > 0)
+			thistdrop();
+		else
+			break;
+	}
+}
+
+/*
+ * Returns the bytes held by the buffers of the terminal. If report is
+ * set, it also prints where they are, along with the font caches of the
+ * window. The caches belong to the other thread and can't be dropped,
+ * so they are left out of the sum. Spill files are left out as well,
+ * as st sees them as disk.
+ */
+size_t
+tmemused(int report)
+{
+	size_t screen, styles, hist, cold, esc, spill = 0;
+	int i;
+
+	screen = term.slab.siz + term.altslab.siz + term.spare.siz +
+	         2 * (term.row + term.altrow) * sizeof(Cell *) +
+	         term.row * sizeof(*term.dirty) + term.col * sizeof(*term.tabs) +
+	         frame.row * (frame.col * sizeof(Glyph) + sizeof(Line) +
+	                      sizeof(*frame.dirty)) + frame.col * sizeof(Glyph);
+	for (i = 0; i < HISTCACHE; i++)
+		screen += term.hcache[i].line ? ROWSIZE(term.hcache[i].col) : 0;
+	styles = term.styles.siz * sizeof(Style) +
+	         term.styles.hashsiz * sizeof(*term.styles.hash);
+	hist = term.histmem + term.histn * sizeof(HistLine *) +
+	       term.segn * sizeof(HistSeg) + term.para.siz * sizeof(uint32_t);
+	cold = term.coldmem + term.coldsiz * sizeof(ColdBlock);
+	esc = strescseq.siz;
+
+	if (report) {
+		for (i = 0; i < term.spilln; i++)
+			spill += term.spill[i].len;
+		fprintf(stderr, "st: %zu KiB in buffers: screen %zu, styles %zu, "
+		        "history %zu, cold %zu, escapes %zu; fonts %zu, "
+		        "spilled %zu\n", (screen + styles + hist + cold + esc) >> 10,
+		        screen >> 10, styles >> 10, hist >> 10, cold >> 10,
+		        esc >> 10, xmemused() >> 10, spill >> 10);
+	}
+	return screen + styles + hist + cold + esc;
+}
+
+/* two lanes of multiply and xor, a cell at a time, the high bits mixed */
+uint32_t
+thisthash(const Cell *c, int len, Cell fill)
+{
+	const uint64_t k = 0x9E3779B97F4A7C15ull;
+	uint64_t h0 = len, h1, v0, v1;
+	int i;
+
+	h1 = fill.u | (uint64_t)fill.s << 32;
+	for (i = 0; i + 1 < len; i += 2) {
+		memcpy(&v0, &c[i], sizeof(v0));
+		memcpy(&v1, &c[i + 1], sizeof(v1));
+		h0 = (h0 ^ v0) * k;
+		h1 = (h1 ^ v1) * k;
+	}
+	if (i < len) {
+		memcpy(&v0, &c[i], sizeof(v0));
+		h0 = (h0 ^ v0) * k;
+	}
+	return (h0 * k + h1) * k >> 32;
+}
+
+void
+thistdedupflush(void)
+{
+	int i;
+
+	for (i = 0; i < DEDUPSIZ; i++) {
+		thistfree(term.dedup[i].h);
+		term.dedup[i].h = NULL;
+	}
+}
+
+/* expands a history line into a row of col cells */
+void
+thistunpack(Cell *line, const HistLine *h, int col)
+{
+	int i = MIN(h->len, col), j;
+	const StyleRun *r;
+	const uchar *t;
+
+	if (!h->runs) {
+		memcpy(line, h->c, i * sizeof(Cell));
+	} else {
+		for (j = 0, r = HRUN(h), t = HTEXT(h); j < i; r++) {
+			for (; j < MIN(r->end, i); j++)
+				line[j] = (Cell){ .u = t[j], .s = r->s };
+		}
+	}
+	for (; i < col; i++)
+		line[i] = h->fill;
+	*LMETA(line) = (LineMeta){ .attr = ~0, .loose = 1, .clr = INT_MAX,
+		.len = CMODE(h->fill) & (ATTR_SET | ATTR_WRAP) ? col : MIN(h->len, col) };
+}
+
+/*
+ * Returns the line of history age lines up, 1 being the newest,
+ * expanded to the width of the screen. The row stays valid until
+ * HISTCACHE other lines are read or the history changes, which is
+ * plenty for readers walking a few lines at a time.
+ */
+const Cell *
+thistline(int age)
+{
+	return thistrow(age, term.col);
+}
+
+/* thistline() expanded to col cells, the width a line was wrapped at */
+const Cell *
+thistrow(int age, int col)
+{
+	HistCache *hc;
+	HistLine *h;
+	int k;
+
+	for (k = 0; k < HISTCACHE; k++) {
+		hc = &term.hcache[k];
+		if (hc->age == age && hc->col == col)
+			return hc->line;
+	}
+	hc = &term.hcache[term.hcnext];
+	term.hcnext = (term.hcnext + 1) % HISTCACHE;
+	if (hc->col != col) {
+		hc->line = trowrealloc(hc->line, col);
+		hc->col = col;
+	}
+	hc->age = age;
+	if (age <= term.histh) {
+		thistunpack(hc->line, term.hist[(term.histi - age + 1 +
+		            term.histn) % term.histn], col);
+	} else {
+		h = tcoldget(age - term.histh);
+		thistunpack(hc->line, h, col);
+		free(h);
+	}
+	return hc->line;
+}
+
+/* forgets the expanded lines, after the history or its styles changed */
+void
+thistflush(void)
+{
+	int k;
+
+	for (k = 0; k < HISTCACHE; k++)
+		term.hcache[k].age = 0;
+}
+
+uchar *
+putvar(uchar *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+	return p;
+}
+
+uint32_t
+getvar(const uchar **p)
+{
+	uint32_t v = 0;
+	int shift = 0;
+
+	do
+		v |= (uint32_t)(**p & 0x7F) << shift, shift += 7;
+	while (*(*p)++ & 0x80);
+	return v;
+}
+
+uchar *
+putstyle(uchar *p, const Style *st)
+{
+	p = putvar(p, st->mode);
+	p = putvar(p, st->fg);
+	return putvar(p, st->bg);
+}
+
+uint32_t
+getstyle(const uchar **p)
+{
+	ushort mode = getvar(p);
+	uint32_t fg = getvar(p);
+
+	return tintern(mode, fg, getvar(p));
+}
+
+/* decodes the cold line age lines up from the newest cold one */
+HistLine *
+tcoldget(int age)
+{
+	const uchar *p, *data;
+	HistLine *h;
+	uint32_t st;
+	int o, i, n;
+
+	o = term.histc - age + term.coldskip;
+	data = term.cold[o / HISTBLOCK].data;
+	if (term.coldidx != data) {
+		for (i = 0, p = data; i < HISTBLOCK; i++) {
+			term.coldoff[i] = p - data;
+			n = getvar(&p);
+			p += n;
+		}
+		term.coldidx = data;
+	}
+
+	p = data + term.coldoff[o % HISTBLOCK];
+	getvar(&p);
+	n = getvar(&p);
+	h = xmalloc(sizeof(*h) + n * sizeof(Cell));
+	h->len = n;
+	h->runs = 0;
+	h->fill.u = getvar(&p);
+	h->fill.s = getstyle(&p);
+	for (i = 0; i < h->len; i++)
+		p += utf8decode((const char *)p, &h->c[i].u, UTF_SIZ);
+	for (i = 0; i < h->len; ) {
+		n = getvar(&p);
+		for (st = getstyle(&p); n > 0; n--)
+			h->c[i++].s = st;
+	}
+	return h;
+}
+
+/* moves the newest cold block back into hist, for rscrolldown() */
+void
+tcoldthaw(void)
+{
+	int n = HISTBLOCK - (term.coldn == 1 ? term.coldskip : 0), k, i;
+	HistLine *h;
+	ColdBlock *b;
+	Spill *s;
+
+	if (term.histn - term.histh < n)
+		thistgrow(term.histh + n);
+	for (k = 1; k <= n; k++) {
+		i = (term.histi - term.histh - k + 1 + term.histn) % term.histn;
+		h = tcoldget(k);
+		thistfree(term.hist[i]);
+		term.hist[i] = thistshare(h->c, h->len, h->fill);
+		free(h);
+	}
+	/* it was the last block written, so its bytes can be reused */
+	b = &term.cold[--term.coldn];
+	if (b->spilled) {
+		s = &term.spill[term.spilln - 1];
+		s->len = b->data - s->map;
+	}
+	tcoldfree(b, term.spilln - 1);
+	if (!term.coldn)
+		term.coldskip = 0;
+	term.coldidx = NULL;
+	term.histc -= n;
+	term.histh += n;
+	thistflush();
+}
+
+/* forgets the oldest line of history */
+void
+tcolddrop(void)
+{
+	term.histc--;
+	term.histf--;
+	tsegdrop(1);
+	tparadrop();
+	if (++term.coldskip < HISTBLOCK)
+		return;
+	tcoldfree(&term.cold[0], 0);
+	memmove(term.cold, term.cold + 1, --term.coldn * sizeof(ColdBlock));
+	term.coldskip = 0;
+	term.coldidx = NULL;
+}
+
+void
+tcoldclear(void)
+{
+	int i;
+
+	for (i = 0; i < term.coldn; i++)
+		tcoldfree(&term.cold[i], 0);
+	term.coldn = term.histc = term.coldskip = 0;
+	term.histf = term.histh;
+	term.coldidx = NULL;
+	thistflush();
+}
+
+/* frees b, whose bytes are in spill file i if it was spilled */
+void
+tcoldfree(ColdBlock *b, int i)
+{
+	if (!b->spilled) {
+		term.coldmem -= b->len;
+		free(b->data);
+	} else if (--term.spill[i].blocks == 0)
+		tspillclose(i);
+}
+
+/* appends a cold block to the spill files, NULL if it stays in memory */
+uchar *
+tspill(const uchar *buf, size_t len)
+{
+	Spill *s = term.spilln ? &term.spill[term.spilln - 1] : NULL;
+	size_t off;
+	ssize_t r;
+
+	if (!histspill || len > SPILLSEG)
+		return NULL;
+	if ((!s || s->len + len > SPILLSEG) && !(s = tspillopen()))
+		return NULL;
+	for (off = 0; off < len; off += r) {
+		if ((r = pwrite(s->fd, buf + off, len - off, s->len + off)) < 0) {
+			if (errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			fprintf(stderr, "histspill: write failed: %s, "
+			        "keeping history in memory\n", strerror(errno));
+			histspill = 0;
+			if (!s->blocks)
+				tspillclose(term.spilln - 1);
+			return NULL;
+		}
+	}
+	s->len += len;
+	s->blocks++;
+	return s->map + s->len - len;
+}
+
+Spill *
+tspillopen(void)
+{
+	const char *dir;
+	char path[PATH_MAX];
+	Spill *s;
+	void *map;
+	int fd;
+
+	if (!(dir = getenv("XDG_RUNTIME_DIR")) || !*dir) {
+		fprintf(stderr, "histspill: XDG_RUNTIME_DIR is not set, "
+		        "keeping history in memory\n");
+		histspill = 0;
+		return NULL;
+	}
+	if (snprintf(path, sizeof(path), "%s/st-hist-XXXXXX", dir) >=
+	    sizeof(path) || (fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "histspill: can't create a file in %s: %s, "
+		        "keeping history in memory\n", dir, strerror(errno));
+		histspill = 0;
+		return NULL;
+	}
+	unlink(path);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	map = mmap(NULL, SPILLSEG, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "histspill: mmap failed: %s, "
+		        "keeping history in memory\n", strerror(errno));
+		close(fd);
+		histspill = 0;
+		return NULL;
+	}
+
+	if (term.spilln == term.spillsiz) {
+		term.spillsiz = MAX(2 * term.spillsiz, 4);
+		term.spill = xrealloc(term.spill, term.spillsiz * sizeof(Spill));
+	}
+	s = &term.spill[term.spilln++];
+	s->map = map;
+	s->fd = fd;
+	s->len = 0;
+	s->blocks = 0;
+	return s;
+}
+
+void
+tspillclose(int i)
+{
+	munmap(term.spill[i].map, SPILLSEG);
+	close(term.spill[i].fd);
+	memmove(term.spill + i, term.spill + i + 1,
+	        (--term.spilln - i) * sizeof(Spill));
+}
+
+/*
+ * Moves the oldest HISTBLOCK lines of hist into a new cold block, as
+ * long as hot lines stay in hist. Returns whether it did.
+ */
+int
+tcoldpack(int hot)
+{
+	static uchar *buf, *tmp;
+	static size_t bufsiz, tmpsiz;
+	const Style *styles = term.styles.s;
+	const HistLine *h;
+	const StyleRun *r;
+	ColdBlock *b;
+	uchar *p, *q;
+	size_t need;
+	int first, i, j, k;
+
+	if (term.histh < hot + HISTBLOCK)
+		return 0;
+
+	first = term.histi - term.histh + 1 + term.histn;
+	for (k = 0, p = buf; k < HISTBLOCK; k++) {
+		h = term.hist[(first + k) % term.histn];
+		if (tmpsiz < (need = 32 + 24 * h->len))
+			tmp = xrealloc(tmp, tmpsiz = need);
+		q = putvar(tmp, h->len);
+		q = putvar(q, h->fill.u);
+		q = putstyle(q, &styles[h->fill.s]);
+		if (h->runs) {
+			/* ASCII is its own UTF-8 */
+			memcpy(q, HTEXT(h), h->len);
+			q += h->len;
+			for (i = 0, r = HRUN(h); i < h->len; i = r->end, r++) {
+				q = putvar(q, r->end - i);
+				q = putstyle(q, &styles[r->s]);
+			}
+		} else {
+			for (i = 0; i < h->len; i++)
+				q += utf8encode(h->c[i].u, (char *)q);
+			for (i = 0; i < h->len; i = j) {
+				for (j = i + 1; j < h->len && h->c[j].s == h->c[i].s; j++)
+					;
+				q = putvar(q, j - i);
+				q = putstyle(q, &styles[h->c[i].s]);
+			}
+		}
+
+		if (bufsiz < (need = (p - buf) + 5 + (q - tmp))) {
+			need = MAX(need, 2 * bufsiz);
+			i = p - buf;
+			buf = xrealloc(buf, bufsiz = need);
+			p = buf + i;
+		}
+		p = putvar(p, q - tmp);
+		memcpy(p, tmp, q - tmp);
+		p += q - tmp;
+	}
+
+	if (term.coldn == term.coldsiz) {
+		term.coldsiz = MAX(2 * term.coldsiz, 16);
+		term.cold = xrealloc(term.cold, term.coldsiz * sizeof(ColdBlock));
+	}
+	b = &term.cold[term.coldn++];
+	b->len = p - buf;
+	if (!(b->spilled = (b->data = tspill(buf, b->len)) != NULL)) {
+		b->data = xmalloc(b->len);
+		memcpy(b->data, buf, b->len);
+		term.coldmem += b->len;
+	}
+
+	for (k = 0; k < HISTBLOCK; k++) {
+		i = (first + k) % term.histn;
+		thistfree(term.hist[i]);
+		term.hist[i] = NULL;
+	}
+	term.histh -= HISTBLOCK;
+	term.histc += HISTBLOCK;
+	thistflush();
+	return 1;
+}
+
+/* wakes the compressor thread if hist grew past histhot */
+void
+tcoldkick(void)
+{
+	if (term.coldbusy || term.histh < histhot + HISTBLOCK)
+		return;
+	term.coldbusy = 1;
+	pthread_once(&coldonce, tcoldstart);
+	pthread_mutex_lock(&coldlock);
+	coldwork = 1;
+	pthread_cond_signal(&coldcond);
+	pthread_mutex_unlock(&coldlock);
+}
+
+void
+tcoldstart(void)
+{
+	pthread_t thread;
+
+	if ((errno = pthread_create(&thread, NULL, tcoldloop, NULL)))
+		die("pthread_create failed: %s\n", strerror(errno));
+	pthread_detach(thread);
+}
+
+/*
+ * Compresses history in the background, a block per tlock() so the
+ * tty thread is never held up for long.
+ */
+void *
+tcoldloop(void *unused)
+{
+	int more;
+
+	for (;;) {
+		pthread_mutex_lock(&coldlock);
+		while (!coldwork)
+			pthread_cond_wait(&coldcond, &coldlock);
+		coldwork = 0;
+		pthread_mutex_unlock(&coldlock);
+
+		do {
+			tlock();
+			if (!(more = tcoldpack(histhot)))
+				term.coldbusy = 0;
+			tunlock();
+		} while (more);
+	}
+	return NULL;
+}
+
+/*
+ * term.line is a window of term.row rows into term.ring, which holds the
+ * rows twice in a row. Scrolling the whole screen moves the window, and
+ * every row is found at term.line[y] wherever the window starts.
+ */
+void
+tsetline(int y, Cell *line)
+{
+	int i = term.line - term.ring + y;
+
+	if (i >= term.row)
+		i -= term.row;
+	term.ring[i] = term.ring[i + term.row] = line;
+}
+
+/* moves the window n rows down the ring, |n| < term.row */
+void
+trotate(int n)
+{
+	int i = term.line - term.ring + n;
+
+	if (i < 0)
+		i += term.row;
+	else if (i >= term.row)
+		i -= term.row;
+	term.line = term.ring + i;
+}
+
+/* copies the first half of the ring into the second one */
+void
+tmirror(void)
+{
+	memcpy(term.ring + term.row, term.ring, term.row * sizeof(Cell *));
+}
+
 void
 selmove(int n)
 {
@@ -1375,34 +3196,29 @@ tnewline(int first_col)
 	tmoveto(first_col ? 0 : term.c.x, y);
 }
 
+/* collect a parameter, private marker or intermediate byte of a CSI */
 void
-csiparse(void)
+csicollect(Rune u)
 {
-	char *p = csiescseq.buf, *np;
-	long int v;
-
-	csiescseq.narg = 0;
-	if (*p == '?') {
-		csiescseq.priv = 1;
-		p++;
-	}
-
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
-		np = NULL;
-		v = strtol(p, &np, 10);
-		if (np == p)
-			v = 0;
-		if (v == LONG_MAX || v == LONG_MIN)
-			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
-		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-			break;
-		p++;
+	int *arg;
+
+	if (csiescseq.len < sizeof(csiescseq.buf))
+		csiescseq.buf[csiescseq.len++] = u;
+
+	if (BETWEEN(u, '0', '9')) {
+		arg = &csiescseq.arg[csiescseq.narg - 1];
+		if (*arg >= 0)
+			*arg = (*arg > (INT_MAX - 9) / 10) ? -1 : *arg * 10 + (u - '0');
+	} else if (u == ';') {
+		if (csiescseq.narg == ESC_ARG_SIZ)
+			term.esc = ESC_CSI_IGNORE;
+		else
+			csiescseq.narg++;
+	} else if (BETWEEN(u, '<', '?')) {
+		csiescseq.priv = u;
+	} else {
+		csiescseq.inter = u;
 	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
 }
 
 /* for absolute user moves, when decom is set */
@@ -1443,59 +3259,236 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
 
-	/*
-	 * The table is proudly stolen from rxvt.
-	 */
-	if (term.trantbl[term.charset] == CS_GRAPHIC0 &&
-	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
-		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
+	/*
+	 * The table is proudly stolen from rxvt.
+	 */
+	if (term.trantbl[term.charset] == CS_GRAPHIC0 &&
+	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
+		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
+
+	/* a blank still pending is no half of a wide character */
+	if (x >= LMETA(term.line[y])->clr) {
+		tlinetake(term.line[y], x, x);
+	} else if (CMODE(term.line[y][x]) & ATTR_WIDE) {
+		if (x+1 < MIN(term.col, LMETA(term.line[y])->clr)) {
+			term.line[y][x+1].u = ' ';
+			tcellmode(&term.line[y][x+1], 0, ATTR_WDUMMY);
+		}
+	} else if (x > 0 && CMODE(term.line[y][x]) & ATTR_WDUMMY) {
+		/* left of column 0 is the LineMeta header, not a wide rune */
+		term.line[y][x-1].u = ' ';
+		tcellmode(&term.line[y][x-1], 0, ATTR_WIDE);
+  }
+
+	term.dirty[y] = 1;
+	term.line[y][x].u = u;
+	term.line[y][x].s = tintern(attr->mode | ATTR_SET |
+	                            (isboxdraw(u) ? ATTR_BOXDRAW : 0),
+	                            attr->fg, attr->bg);
+	tlinewiden(term.line[y], x, CMODE(term.line[y][x]));
+}
+
+void
+tclearglyph(Cell *gp, int usecurattr)
+{
+	if (usecurattr)
+		gp->s = tintern(ATTR_NULL, term.c.attr.fg, term.c.attr.bg);
+	else
+		gp->s = tintern(ATTR_NULL, defaultfg, defaultbg);
+	gp->u = ' ';
+}
+
+/* sets the mode bits in set and clears those in clr, keeping the colors */
+void
+tcellmode(Cell *c, int set, int clr)
+{
+	Style *st = &CSTYLE(*c);
+
+	c->s = tintern((st->mode & ~clr) | set, st->fg, st->bg);
+}
+
+/* returns the index of the style, adding it to term.styles if it is new */
+uint32_t
+tintern(ushort mode, uint32_t fg, uint32_t bg)
+{
+	StyleTable *t = &term.styles;
+	Style *st = &t->s[t->last];
+	uint32_t i;
+
+	if (t->n > 0 && st->mode == mode && st->fg == fg && st->bg == bg)
+		return t->last;
+
+	i = (mode * 0x9E3779B1u) ^ (fg * 0x85EBCA77u) ^ (bg * 0xC2B2AE3Du);
+	for (i ^= i >> 15;; i++) {
+		i &= t->hashsiz - 1;
+		if (!t->hash[i])
+			break;
+		st = &t->s[t->hash[i] - 1];
+		if (st->mode == mode && st->fg == fg && st->bg == bg)
+			return t->last = t->hash[i] - 1;
+	}
+
+	if (t->n == t->siz)
+		t->s = xrealloc(t->s, (t->siz *= 2) * sizeof(Style));
+	t->s[t->n] = (Style){ .mode = mode, .fg = fg, .bg = bg };
+	t->hash[i] = ++t->n;
+	if (2 * t->n > t->hashsiz)
+		trehash(2 * t->hashsiz);
+	return t->last = t->n - 1;
+}
+
+void
+trehash(uint32_t siz)
+{
+	StyleTable *t = &term.styles;
+	uint32_t n = t->n, i;
+
+	free(t->hash);
+	t->hash = xmalloc(siz * sizeof(*t->hash));
+	memset(t->hash, 0, siz * sizeof(*t->hash));
+	t->hashsiz = siz;
+	t->n = t->last = 0;
+	/* interning them again in order keeps every index */
+	for (i = 0; i < n; i++)
+		tintern(t->s[i].mode, t->s[i].fg, t->s[i].bg);
+}
+
+/*
+ * Drops the styles no cell uses anymore and renumbers the rest. It must
+ * only run where no style index is held outside of the cells.
+ */
+void
+tstylegc(void)
+{
+	StyleTable *t = &term.styles;
+	Cell **screens[2] = {term.line, term.altline}, *c, *end;
+	int rows[2] = {term.row, term.altrow}, cols[2] = {term.col, term.altcol};
+	LineMeta *m;
+	HistLine *h;
+	StyleRun *r;
+	int i, y;
+	uint32_t *map, n;
+
+	map = xmalloc(t->n * sizeof(*map));
+	memset(map, 0, t->n * sizeof(*map));
+	map[0] = 1; /* the default style stays at 0 */
+
+	/* cells under a pending blank may never have been written */
+	for (i = 0; i < 2; i++) {
+		for (y = 0; y < rows[i]; y++) {
+			m = LMETA(screens[i][y]);
+			if (m->clr < cols[i])
+				map[m->clrs] = 1;
+			c = screens[i][y], end = c + MIN(m->clr, cols[i]);
+			for (; c < end; c++)
+				map[c->s] = 1;
+		}
+	}
+	thistdedupflush();
+	for (y = 0; y < term.histn; y++) {
+		if (!(h = term.hist[y]))
+			continue;
+		map[h->fill.s] = 1;
+		for (r = HRUN(h); r < HRUN(h) + h->runs; r++)
+			map[r->s] = 1;
+		for (c = h->c, end = c + (h->runs ? 0 : h->len); c < end; c++)
+			map[c->s] = 1;
+	}
+
+	for (i = n = 0; i < t->n; i++)
+		if (map[i])
+			t->s[map[i] = n++] = t->s[i];
 
-	if (term.line[y][x].mode & ATTR_WIDE) {
-		if (x+1 < term.col) {
-			term.line[y][x+1].u = ' ';
-			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
+	for (i = 0; i < 2; i++) {
+		for (y = 0; y < rows[i]; y++) {
+			m = LMETA(screens[i][y]);
+			if (m->clr < cols[i])
+				m->clrs = map[m->clrs];
+			c = screens[i][y], end = c + MIN(m->clr, cols[i]);
+			for (; c < end; c++)
+				c->s = map[c->s];
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
-		term.line[y][x-1].u = ' ';
-		term.line[y][x-1].mode &= ~ATTR_WIDE;
-  }
+	}
+	/* shared lines are done once, their ref is negated until the end */
+	for (y = 0; y < term.histn; y++) {
+		if (!(h = term.hist[y]) || h->ref < 0)
+			continue;
+		h->fill.s = map[h->fill.s];
+		for (r = HRUN(h); r < HRUN(h) + h->runs; r++)
+			r->s = map[r->s];
+		for (c = h->c, end = c + (h->runs ? 0 : h->len); c < end; c++)
+			c->s = map[c->s];
+		h->ref = -h->ref;
+	}
+	for (y = 0; y < term.histn; y++)
+		if ((h = term.hist[y]) && h->ref < 0)
+			h->ref = -h->ref;
+	thistflush();
+
+	t->n = n;
+	t->gc = MAX(STYLE_GC_MIN, 2 * n);
+	trehash(t->hashsiz);
+	free(map);
+}
 
-	term.dirty[y] = 1;
-	term.line[y][x] = *attr;
-	term.line[y][x].u = u;
+/* expands cells into the glyphs x.c draws */
+void
+tunpack(Glyph *g, const Cell *c, int n)
+{
+	const Style *st;
 
-	if (isboxdraw(u))
-		term.line[y][x].mode |= ATTR_BOXDRAW;
-	term.line[y][x].mode |= ATTR_SET;
+	for (; n > 0; n--, g++, c++) {
+		st = &CSTYLE(*c);
+		*g = (Glyph){ .u = c->u, .mode = st->mode, .fg = st->fg, .bg = st->bg };
+	}
 }
 
+/* expands a screen row, its pending blanks without writing them out */
 void
-tclearglyph(Glyph *gp, int usecurattr)
+tunpackrow(Glyph *g, const Cell *line)
 {
-	if (usecurattr) {
-		gp->fg = term.c.attr.fg;
-		gp->bg = term.c.attr.bg;
-	} else {
-		gp->fg = defaultfg;
-		gp->bg = defaultbg;
+	int n = MIN(LMETA(line)->clr, term.col), i;
+	Cell blank = { .u = ' ', .s = LMETA(line)->clrs };
+
+	tunpack(g, line, n);
+	if (n < term.col) {
+		tunpack(&g[n], &blank, 1);
+		for (i = n + 1; i < term.col; i++)
+			g[i] = g[n];
 	}
-	gp->mode = ATTR_NULL;
-	gp->u = ' ';
 }
 
 void
 tclearregion(int x1, int y1, int x2, int y2, int usecurattr)
 {
 	int x, y;
+	Cell blank, *line;
+	LineMeta *m;
 
 	/* regionselected() takes relative coordinates */
 	if (regionselected(x1+term.scr, y1+term.scr, x2+term.scr, y2+term.scr))
 		selremove();
 
+	tclearglyph(&blank, usecurattr);
 	for (y = y1; y <= y2; y++) {
 		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++)
-			tclearglyph(&term.line[y][x], usecurattr);
+		line = term.line[y];
+		m = LMETA(line);
+		/* blanks have no mode, so a row cleared to its end got shorter */
+		if (x1 == 0 && x2 == term.col - 1) {
+			*m = (LineMeta){ .clrs = blank.s };
+		} else if (x2 == term.col - 1) {
+			tlinefill(line, x1);
+			m->clr = x1;
+			m->clrs = blank.s;
+			m->len = MIN(m->len, x1);
+			m->loose = 1;
+		} else {
+			tlinetake(line, x1, x2);
+			for (x = x1; x <= x2; x++)
+				line[x] = blank;
+			m->loose = 1;
+		}
 	}
 }
 
@@ -1503,7 +3496,7 @@ void
 tdeletechar(int n)
 {
 	int src, dst, size;
-	Line line;
+	Cell *line;
 
 	if (n <= 0)
 		return;
@@ -1512,8 +3505,8 @@ tdeletechar(int n)
 	size = term.col - src;
 	if (size > 0) { /* otherwise src would point beyond the array
 	                   https://stackoverflow.com/questions/29844298 */
-		line = term.line[term.c.y];
-		memmove(&line[dst], &line[src], size * sizeof(Glyph));
+		line = tlinefill(term.line[term.c.y], term.col);
+		memmove(&line[dst], &line[src], size * sizeof(Cell));
 	}
 	tclearregion(dst + size, term.c.y, term.col - 1, term.c.y, 1);
 }
@@ -1522,7 +3515,7 @@ void
 tinsertblank(int n)
 {
 	int src, dst, size;
-	Line line;
+	Cell *line;
 
 	if (n <= 0)
 		return;
@@ -1530,8 +3523,9 @@ tinsertblank(int n)
 	src = term.c.x;
 	size = term.col - dst;
 	if (size > 0) { /* otherwise dst would point beyond the array */
-		line = term.line[term.c.y];
-		memmove(&line[dst], &line[src], size * sizeof(Glyph));
+		line = tlinefill(term.line[term.c.y], term.col);
+		memmove(&line[dst], &line[src], size * sizeof(Cell));
+		LMETA(line)->len = MIN(LMETA(line)->len + n, term.col);
 	}
 	tclearregion(src, term.c.y, dst - 1, term.c.y, 1);
 }
@@ -1841,235 +3835,401 @@ tsetmode(int priv, int set, const int *args, int narg)
 	}
 }
 
-void
-csihandle(void)
+/*
+ * CSI handlers, indexed by final byte in csihandlers[] (no intermediate)
+ * and csisphandlers[] (SP intermediate). They return -1 when the
+ * parameters are not supported, so that the sequence is dumped.
+ */
+int
+csiich(void) /* ICH -- Insert <n> blank char */
 {
-	char buf[40];
-	int n, x;
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblank(csiescseq.arg[0]);
+	return 0;
+}
 
-	switch (csiescseq.mode[0]) {
-	default:
-	unknown:
-		fprintf(stderr, "erresc: unknown csi ");
-		csidump();
-		/* die(""); */
-		break;
-	case '@': /* ICH -- Insert <n> blank char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblank(csiescseq.arg[0]);
-		break;
-	case 'A': /* CUU -- Cursor <n> Up */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
-		break;
-	case 'B': /* CUD -- Cursor <n> Down */
-	case 'e': /* VPR --Cursor <n> Down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
-		break;
-	case 'i': /* MC -- Media Copy */
-		switch (csiescseq.arg[0]) {
-		case 0:
-			tdump();
-			break;
-		case 1:
-			tdumpline(term.c.y);
-			break;
-		case 2:
-			tdumpsel();
-			break;
-		case 4:
-			term.mode &= ~MODE_PRINT;
-			break;
-		case 5:
-			term.mode |= MODE_PRINT;
-			break;
-		}
-		break;
-	case 'c': /* DA -- Device Attributes */
-		if (csiescseq.arg[0] == 0)
-			ttywrite(vtiden, strlen(vtiden), 0);
-		break;
-	case 'b': /* REP -- if last char is printable print it <n> more times */
-		DEFAULT(csiescseq.arg[0], 1);
-		if (term.lastc)
-			while (csiescseq.arg[0]-- > 0)
-				tputc(term.lastc);
-		break;
-	case 'C': /* CUF -- Cursor <n> Forward */
-	case 'a': /* HPR -- Cursor <n> Forward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
-		break;
-	case 'D': /* CUB -- Cursor <n> Backward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
-		break;
-	case 'E': /* CNL -- Cursor <n> Down and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y+csiescseq.arg[0]);
-		break;
-	case 'F': /* CPL -- Cursor <n> Up and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y-csiescseq.arg[0]);
-		break;
-	case 'g': /* TBC -- Tabulation clear */
-		switch (csiescseq.arg[0]) {
-		case 0: /* clear current tab stop */
-			term.tabs[term.c.x] = 0;
-			break;
-		case 3: /* clear all the tabs */
-			memset(term.tabs, 0, term.col * sizeof(*term.tabs));
-			break;
-		default:
-			goto unknown;
-		}
-		break;
-	case 'G': /* CHA -- Move to <col> */
-	case '`': /* HPA */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(csiescseq.arg[0]-1, term.c.y);
-		break;
-	case 'H': /* CUP -- Move to <row> <col> */
-	case 'f': /* HVP */
-		DEFAULT(csiescseq.arg[0], 1);
-		DEFAULT(csiescseq.arg[1], 1);
-		tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
-		break;
-	case 'I': /* CHT -- Cursor Forward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(csiescseq.arg[0]);
-		break;
-	case 'J': /* ED -- Clear screen */
-		switch (csiescseq.arg[0]) {
-		case 0: /* below */
-			tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
-			if (term.c.y < term.row-1) {
-				tclearregion(0, term.c.y+1, term.col-1, term.row-1, 1);
-			}
-			break;
-		case 1: /* above */
-			if (term.c.y >= 1)
-				tclearregion(0, 0, term.col-1, term.c.y-1, 1);
-			tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
-			break;
-		case 2: /* all */
-			if (IS_SET(MODE_ALTSCREEN)) {
-  			tclearregion(0, 0, term.col-1, term.row-1, 1);
-  			break;
-      }
-			/* vte does this:
-			tscrollup(0, term.row-1, term.row, SCROLL_SAVEHIST); */
-      
-			/* alacritty does this: */
-			for (n = term.row-1; n >= 0 && tlinelen(term.line[n]) == 0; n--);
-			if (n >= 0)
-				tscrollup(0, term.row-1, n+1, SCROLL_SAVEHIST);
-			tscrollup(0, term.row-1, term.row-n-1, SCROLL_NOSAVEHIST);
-      break;
-		default:
-			goto unknown;
-		}
-		break;
-	case 'K': /* EL -- Clear line */
-		switch (csiescseq.arg[0]) {
-		case 0: /* right */
-			tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
-			break;
-		case 1: /* left */
-			tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
-			break;
-		case 2: /* all */
-			tclearregion(0, term.c.y, term.col-1, term.c.y, 1);
-			break;
-		}
-		break;
-	case 'S': /* SU -- Scroll <n> line up */
-		DEFAULT(csiescseq.arg[0], 1);
-		/* xterm, urxvt, alacritty save this in history */
-		tscrollup(term.top, term.bot, csiescseq.arg[0], SCROLL_SAVEHIST);
-		break;
-	case 'T': /* SD -- Scroll <n> line down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0]);
-		break;
-	case 'L': /* IL -- Insert <n> blank lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblankline(csiescseq.arg[0]);
-		break;
-	case 'l': /* RM -- Reset Mode */
-		tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
-		break;
-	case 'M': /* DL -- Delete <n> lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeleteline(csiescseq.arg[0]);
-		break;
-	case 'X': /* ECH -- Erase <n> char */
-		if (csiescseq.arg[0] < 0)
-			return;
-		DEFAULT(csiescseq.arg[0], 1);
-		x = MIN(term.c.x + csiescseq.arg[0], term.col) - 1;
-		tclearregion(term.c.x, term.c.y, x, term.c.y, 1);
-		break;
-	case 'P': /* DCH -- Delete <n> char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeletechar(csiescseq.arg[0]);
+int
+csicuu(void) /* CUU -- Cursor <n> Up */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicud(void) /* CUD, VPR -- Cursor <n> Down */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csimc(void) /* MC -- Media Copy */
+{
+	switch (csiescseq.arg[0]) {
+	case 0:
+		tdump();
 		break;
-	case 'Z': /* CBT -- Cursor Backward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(-csiescseq.arg[0]);
+	case 1:
+		tdumpline(term.c.y);
 		break;
-	case 'd': /* VPA -- Move to <row> */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveato(term.c.x, csiescseq.arg[0]-1);
+	case 2:
+		tdumpsel();
 		break;
-	case 'h': /* SM -- Set terminal mode */
-		tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+	case 4:
+		term.mode &= ~MODE_PRINT;
 		break;
-	case 'm': /* SGR -- Terminal attribute (color) */
-		tsetattr(csiescseq.arg, csiescseq.narg);
+	case 5:
+		term.mode |= MODE_PRINT;
 		break;
-	case 'n': /* DSR -- Device Status Report */
-		switch (csiescseq.arg[0]) {
-		case 5: /* Status Report "OK" `0n` */
-			ttywrite("\033[0n", sizeof("\033[0n") - 1, 0);
-			break;
-		case 6: /* Report Cursor Position (CPR) "<row>;<column>R" */
-			n = snprintf(buf, sizeof(buf), "\033[%i;%iR",
-			               term.c.y+1, term.c.x+1);
-			ttywrite(buf, n, 0);
-			break;
-		default:
-			goto unknown;
+	}
+	return 0;
+}
+
+int
+csida(void) /* DA -- Device Attributes */
+{
+	if (csiescseq.arg[0] == 0)
+		ttywrite(vtiden, strlen(vtiden), 0);
+	return 0;
+}
+
+int
+csirep(void) /* REP -- if last char is printable print it <n> more times */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	if (term.lastc)
+		while (csiescseq.arg[0]-- > 0)
+			tputc(term.lastc);
+	return 0;
+}
+
+int
+csicuf(void) /* CUF, HPR -- Cursor <n> Forward */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
+	return 0;
+}
+
+int
+csicub(void) /* CUB -- Cursor <n> Backward */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
+	return 0;
+}
+
+int
+csicnl(void) /* CNL -- Cursor <n> Down and first col */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y+csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicpl(void) /* CPL -- Cursor <n> Up and first col */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(0, term.c.y-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csitbc(void) /* TBC -- Tabulation clear */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* clear current tab stop */
+		term.tabs[term.c.x] = 0;
+		return 0;
+	case 3: /* clear all the tabs */
+		memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+		return 0;
+	}
+	return -1;
+}
+
+int
+csicha(void) /* CHA, HPA -- Move to <col> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveto(csiescseq.arg[0]-1, term.c.y);
+	return 0;
+}
+
+int
+csicup(void) /* CUP, HVP -- Move to <row> <col> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], 1);
+	tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
+	return 0;
+}
+
+int
+csicht(void) /* CHT -- Cursor Forward Tabulation <n> tab stops */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csied(void) /* ED -- Clear screen */
+{
+	int n;
+
+	switch (csiescseq.arg[0]) {
+	case 0: /* below */
+		tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
+		if (term.c.y < term.row-1) {
+			tclearregion(0, term.c.y+1, term.col-1, term.row-1, 1);
 		}
-		break;
-	case 'r': /* DECSTBM -- Set Scrolling Region */
-		if (csiescseq.priv) {
-			goto unknown;
-		} else {
-			DEFAULT(csiescseq.arg[0], 1);
-			DEFAULT(csiescseq.arg[1], term.row);
-			tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
-			tmoveato(0, 0);
+		return 0;
+	case 1: /* above */
+		if (term.c.y >= 1)
+			tclearregion(0, 0, term.col-1, term.c.y-1, 1);
+		tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
+		return 0;
+	case 2: /* all */
+		if (IS_SET(MODE_ALTSCREEN)) {
+			tclearregion(0, 0, term.col-1, term.row-1, 1);
+			return 0;
 		}
+		/* vte does this:
+		tscrollup(0, term.row-1, term.row, SCROLL_SAVEHIST); */
+
+		/* alacritty does this: */
+		for (n = term.row-1; n >= 0 && tlinelen(term.line[n]) == 0; n--);
+		if (n >= 0)
+			tscrollup(0, term.row-1, n+1, SCROLL_SAVEHIST);
+		tscrollup(0, term.row-1, term.row-n-1, SCROLL_NOSAVEHIST);
+		return 0;
+	}
+	return -1;
+}
+
+int
+csiel(void) /* EL -- Clear line */
+{
+	switch (csiescseq.arg[0]) {
+	case 0: /* right */
+		tclearregion(term.c.x, term.c.y, term.col-1, term.c.y, 1);
 		break;
-	case 's': /* DECSC -- Save cursor position (ANSI.SYS) */
-		tcursor(CURSOR_SAVE);
-		break;
-	case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
-		tcursor(CURSOR_LOAD);
+	case 1: /* left */
+		tclearregion(0, term.c.y, term.c.x, term.c.y, 1);
 		break;
-	case ' ':
-		switch (csiescseq.mode[1]) {
-		case 'q': /* DECSCUSR -- Set Cursor Style */
-			if (xsetcursor(csiescseq.arg[0]))
-				goto unknown;
-			break;
-		default:
-			goto unknown;
-		}
+	case 2: /* all */
+		tclearregion(0, term.c.y, term.col-1, term.c.y, 1);
 		break;
 	}
+	return 0;
+}
+
+int
+csisu(void) /* SU -- Scroll <n> line up */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	/* xterm, urxvt, alacritty save this in history */
+	tscrollup(term.top, term.bot, csiescseq.arg[0], SCROLL_SAVEHIST);
+	return 0;
+}
+
+int
+csisd(void) /* SD -- Scroll <n> line down */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tscrolldown(term.top, csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csiil(void) /* IL -- Insert <n> blank lines */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tinsertblankline(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csirm(void) /* RM -- Reset Mode */
+{
+	tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csidl(void) /* DL -- Delete <n> lines */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeleteline(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csiech(void) /* ECH -- Erase <n> char */
+{
+	int x;
+
+	if (csiescseq.arg[0] < 0)
+		return 0;
+	DEFAULT(csiescseq.arg[0], 1);
+	x = MIN(term.c.x + csiescseq.arg[0], term.col) - 1;
+	tclearregion(term.c.x, term.c.y, x, term.c.y, 1);
+	return 0;
+}
+
+int
+csidch(void) /* DCH -- Delete <n> char */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tdeletechar(csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csicbt(void) /* CBT -- Cursor Backward Tabulation <n> tab stops */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tputtab(-csiescseq.arg[0]);
+	return 0;
+}
+
+int
+csivpa(void) /* VPA -- Move to <row> */
+{
+	DEFAULT(csiescseq.arg[0], 1);
+	tmoveato(term.c.x, csiescseq.arg[0]-1);
+	return 0;
+}
+
+int
+csism(void) /* SM -- Set terminal mode */
+{
+	tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csisgr(void) /* SGR -- Terminal attribute (color) */
+{
+	tsetattr(csiescseq.arg, csiescseq.narg);
+	return 0;
+}
+
+int
+csidsr(void) /* DSR -- Device Status Report */
+{
+	char buf[40];
+	int n;
+
+	switch (csiescseq.arg[0]) {
+	case 5: /* Status Report "OK" `0n` */
+		ttywrite("\033[0n", sizeof("\033[0n") - 1, 0);
+		return 0;
+	case 6: /* Report Cursor Position (CPR) "<row>;<column>R" */
+		n = snprintf(buf, sizeof(buf), "\033[%i;%iR",
+		               term.c.y+1, term.c.x+1);
+		ttywrite(buf, n, 0);
+		return 0;
+	}
+	return -1;
+}
+
+int
+csistbm(void) /* DECSTBM -- Set Scrolling Region */
+{
+	if (csiescseq.priv)
+		return -1;
+	DEFAULT(csiescseq.arg[0], 1);
+	DEFAULT(csiescseq.arg[1], term.row);
+	tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
+	tmoveato(0, 0);
+	return 0;
+}
+
+int
+csiscp(void) /* DECSC -- Save cursor position (ANSI.SYS) */
+{
+	tcursor(CURSOR_SAVE);
+	return 0;
+}
+
+int
+csircp(void) /* DECRC -- Restore cursor position (ANSI.SYS) */
+{
+	tcursor(CURSOR_LOAD);
+	return 0;
+}
+
+int
+csiscusr(void) /* DECSCUSR -- Set Cursor Style */
+{
+	return xsetcursor(csiescseq.arg[0]) ? -1 : 0;
+}
+
+static int (*const csihandlers[128])(void) = {
+	['@'] = csiich,
+	['A'] = csicuu,
+	['B'] = csicud,
+	['C'] = csicuf,
+	['D'] = csicub,
+	['E'] = csicnl,
+	['F'] = csicpl,
+	['G'] = csicha,
+	['H'] = csicup,
+	['I'] = csicht,
+	['J'] = csied,
+	['K'] = csiel,
+	['L'] = csiil,
+	['M'] = csidl,
+	['P'] = csidch,
+	['S'] = csisu,
+	['T'] = csisd,
+	['X'] = csiech,
+	['Z'] = csicbt,
+	['`'] = csicha,  /* HPA */
+	['a'] = csicuf,  /* HPR */
+	['b'] = csirep,
+	['c'] = csida,
+	['d'] = csivpa,
+	['e'] = csicud,  /* VPR */
+	['f'] = csicup,  /* HVP */
+	['g'] = csitbc,
+	['h'] = csism,
+	['i'] = csimc,
+	['l'] = csirm,
+	['m'] = csisgr,
+	['n'] = csidsr,
+	['r'] = csistbm,
+	['s'] = csiscp,
+	['u'] = csircp,
+};
+
+static int (*const csisphandlers[128])(void) = {
+	['q'] = csiscusr,
+};
+
+void
+csihandle(void)
+{
+	int (*handler)(void) = NULL;
+
+	/* only the DEC private marker is understood */
+	if (!csiescseq.priv || csiescseq.priv == '?') {
+		if (!csiescseq.inter)
+			handler = csihandlers[(uchar)csiescseq.mode];
+		else if (csiescseq.inter == ' ')
+			handler = csisphandlers[(uchar)csiescseq.mode];
+	}
+
+	if (!handler || handler() < 0) {
+		fprintf(stderr, "erresc: unknown csi ");
+		csidump();
+		/* die(""); */
+	}
 }
 
 void
@@ -2093,13 +4253,17 @@ csidump(void)
 			fprintf(stderr, "(%02x)", c);
 		}
 	}
+	putc(csiescseq.mode, stderr);
 	putc('\n', stderr);
 }
 
 void
 csireset(void)
 {
-	memset(&csiescseq, 0, sizeof(csiescseq));
+	csiescseq.len = 0;
+	csiescseq.priv = csiescseq.inter = 0;
+	memset(csiescseq.arg, 0, sizeof(csiescseq.arg));
+	csiescseq.narg = 1;
 }
 
 void
@@ -2138,7 +4302,6 @@ strhandle(void)
 		{ defaultcs, "cursor" }
 	};
 
-	term.esc &= ~(ESC_STR_END|ESC_STR);
 	strparse();
 	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -2256,7 +4419,7 @@ externalpipe(const Arg *arg)
 	int to[2];
 	char buf[UTF_SIZ];
 	void (*oldsigpipe)(int);
-	Glyph *bp, *end;
+	const Cell *bp, *end;
 	int lastpos, n, newline;
 
 	if (pipe(to) == -1)
@@ -2280,9 +4443,10 @@ externalpipe(const Arg *arg)
 	close(to[0]);
 	/* ignore sigpipe for now, in case child exists early */
 	oldsigpipe = signal(SIGPIPE, SIG_IGN);
+	thistrewrap(term.histf);
 	newline = 0;
-	for (n = 0; n <= HISTSIZE + 2; n++) {
-		bp = TLINE_HIST(n);
+	for (n = -term.histf; n < term.row; n++) {
+		bp = TLINEABS(n);
 		lastpos = MIN(tlinehistlen(n) + 1, term.col) - 1;
 		if (lastpos < 0)
 			break;
@@ -2292,7 +4456,7 @@ externalpipe(const Arg *arg)
 		for (; bp < end; ++bp)
 			if (xwrite(to[1], buf, utf8encode(bp->u, buf)) < 0)
 				break;
-		if ((newline = TLINE_HIST(n)[lastpos].mode & ATTR_WRAP))
+		if ((newline = CMODE(TLINEABS(n)[lastpos]) & ATTR_WRAP))
 			continue;
 		if (xwrite(to[1], "\n", 1) < 0)
 			break;
@@ -2370,6 +4534,12 @@ printscreen(const Arg *arg)
 	tdump();
 }
 
+void
+memreport(const Arg *arg)
+{
+	tmemused(1);
+}
+
 void
 printsel(const Arg *arg)
 {
@@ -2391,7 +4561,7 @@ void
 tdumpline(int n)
 {
 	char str[(term.col + 1) * UTF_SIZ];
-  tprinter(str, tgetline(str, &term.line[n][0]));
+  tprinter(str, tgetline(str, tlinefill(term.line[n], term.col)));
 }
 
 void
@@ -2475,7 +4645,7 @@ tstrsequence(uchar c)
 	}
 	strreset();
 	strescseq.type = c;
-	term.esc |= ESC_STR;
+	term.esc = ESC_STR;
 }
 
 void
@@ -2498,17 +4668,7 @@ tcontrolcode(uchar ascii)
 		tnewline(IS_SET(MODE_CRLF));
 		return;
 	case '\a':   /* BEL */
-		if (term.esc & ESC_STR_END) {
-			/* backwards compatibility to xterm */
-			strhandle();
-		} else {
-			xbell();
-		}
-		break;
-	case '\033': /* ESC */
-		csireset();
-		term.esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-		term.esc |= ESC_START;
+		xbell();
 		return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
@@ -2571,45 +4731,20 @@ tcontrolcode(uchar ascii)
 		tstrsequence(ascii);
 		return;
 	}
-	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term.esc &= ~(ESC_STR_END|ESC_STR);
 }
 
 /*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
+ * handles ESC <final>; the introducers of CSI, strings, charsets,
+ * tests and UTF-8 selection are transitions of vttable
  */
-int
+void
 eschandle(uchar ascii)
 {
 	switch (ascii) {
-	case '[':
-		term.esc |= ESC_CSI;
-		return 0;
-	case '#':
-		term.esc |= ESC_TEST;
-		return 0;
-	case '%':
-		term.esc |= ESC_UTF8;
-		return 0;
-	case 'P': /* DCS -- Device Control String */
-	case '_': /* APC -- Application Program Command */
-	case '^': /* PM -- Privacy Message */
-	case ']': /* OSC -- Operating System Command */
-	case 'k': /* old title set compatibility */
-		tstrsequence(ascii);
-		return 0;
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
 		term.charset = 2 + (ascii - 'n');
 		break;
-	case '(': /* GZD4 -- set primary charset G0 */
-	case ')': /* G1D4 -- set secondary charset G1 */
-	case '*': /* G2D4 -- set tertiary charset G2 */
-	case '+': /* G3D4 -- set quaternary charset G3 */
-		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
 	case 'D': /* IND -- Linefeed */
 		if (term.c.y == term.bot) {
 			tscrollup(term.top, term.bot, 1, SCROLL_SAVEHIST);
@@ -2650,138 +4785,283 @@ eschandle(uchar ascii)
 	case '8': /* DECRC -- Restore Cursor */
 		tcursor(CURSOR_LOAD);
 		break;
-	case '\\': /* ST -- String Terminator */
-		if (term.esc & ESC_STR_END)
-			strhandle();
+	case '\\': /* ST -- String Terminator, without a string */
 		break;
 	default:
 		fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
 			(uchar) ascii, isprint(ascii)? ascii:'.');
 		break;
 	}
-	return 1;
 }
 
+#define VT(act, st)	((act) << 4 | (st))
+
+/* escape class of each ASCII rune */
+static const uchar vtclass[128] = {
+	[0x00 ... 0x1f] = CLS_C0,
+	['\a'] = CLS_BEL,
+	['\030'] = CLS_CAN,
+	['\032'] = CLS_CAN,
+	['\033'] = CLS_ESC,
+	[0x20 ... 0x2f] = CLS_INTER,
+	['#'] = CLS_HASH,
+	['%'] = CLS_PERCENT,
+	['(' ... '+'] = CLS_CHARSET,
+	['0' ... '9'] = CLS_DIGIT,
+	[':'] = CLS_COLON,
+	[';'] = CLS_SEMI,
+	['<' ... '?'] = CLS_PRIV,
+	[0x40 ... 0x7e] = CLS_FINAL,
+	['['] = CLS_CSI,
+	['\\'] = CLS_ST,
+	['P'] = CLS_STR,
+	[']'] = CLS_STR,
+	['^'] = CLS_STR,
+	['_'] = CLS_STR,
+	['k'] = CLS_STR,
+	[0x7f] = CLS_DEL,
+};
+
+/* transitions shared by every state but the ground and string ones */
+#define VTANYWHERE(st) \
+	[CLS_C0] = VT(ACT_EXECUTE, st), \
+	[CLS_BEL] = VT(ACT_EXECUTE, st), \
+	[CLS_CAN] = VT(ACT_EXECUTE, ESC_GROUND), \
+	[CLS_ESC] = VT(ACT_CLEAR, ESC_ESCAPE), \
+	[CLS_DEL] = VT(ACT_NONE, st), \
+	[CLS_C1] = VT(ACT_EXECUTE, st)
+
+static const uchar vttable[ESC_NSTATES][CLS_NCLASSES] = {
+	[ESC_GROUND] = {
+		[CLS_C0 ... CLS_C1] = VT(ACT_EXECUTE, ESC_GROUND),
+		[CLS_ESC] = VT(ACT_CLEAR, ESC_ESCAPE),
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_PRINT, ESC_GROUND),
+	},
+	[ESC_ESCAPE] = {
+		VTANYWHERE(ESC_ESCAPE),
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_ESCDISPATCH, ESC_GROUND),
+		[CLS_HASH] = VT(ACT_NONE, ESC_TEST),
+		[CLS_PERCENT] = VT(ACT_NONE, ESC_UTF8),
+		[CLS_CHARSET] = VT(ACT_CHARSET, ESC_CHARSET),
+		[CLS_CSI] = VT(ACT_NONE, ESC_CSI_ENTRY),
+		[CLS_STR] = VT(ACT_STRSTART, ESC_STR),
+	},
+	[ESC_CHARSET] = {
+		VTANYWHERE(ESC_CHARSET),
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_DEFTRAN, ESC_GROUND),
+	},
+	[ESC_TEST] = {
+		VTANYWHERE(ESC_TEST),
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_DECTEST, ESC_GROUND),
+	},
+	[ESC_UTF8] = {
+		VTANYWHERE(ESC_UTF8),
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_DEFUTF8, ESC_GROUND),
+	},
+	[ESC_CSI_ENTRY] = {
+		VTANYWHERE(ESC_CSI_ENTRY),
+		[CLS_INTER ... CLS_CHARSET] = VT(ACT_CSICOLLECT, ESC_CSI_INTER),
+		[CLS_DIGIT ... CLS_PRIV] = VT(ACT_CSICOLLECT, ESC_CSI_PARAM),
+		[CLS_COLON] = VT(ACT_NONE, ESC_CSI_IGNORE),
+		[CLS_CSI ... CLS_FINAL] = VT(ACT_CSIDISPATCH, ESC_GROUND),
+		[CLS_PRINT] = VT(ACT_NONE, ESC_CSI_IGNORE),
+	},
+	[ESC_CSI_PARAM] = {
+		VTANYWHERE(ESC_CSI_PARAM),
+		[CLS_INTER ... CLS_CHARSET] = VT(ACT_CSICOLLECT, ESC_CSI_INTER),
+		[CLS_DIGIT ... CLS_SEMI] = VT(ACT_CSICOLLECT, ESC_CSI_PARAM),
+		[CLS_COLON] = VT(ACT_NONE, ESC_CSI_IGNORE),
+		[CLS_PRIV] = VT(ACT_NONE, ESC_CSI_IGNORE),
+		[CLS_CSI ... CLS_FINAL] = VT(ACT_CSIDISPATCH, ESC_GROUND),
+		[CLS_PRINT] = VT(ACT_NONE, ESC_CSI_IGNORE),
+	},
+	[ESC_CSI_INTER] = {
+		VTANYWHERE(ESC_CSI_INTER),
+		[CLS_INTER ... CLS_CHARSET] = VT(ACT_CSICOLLECT, ESC_CSI_INTER),
+		[CLS_DIGIT ... CLS_PRIV] = VT(ACT_NONE, ESC_CSI_IGNORE),
+		[CLS_CSI ... CLS_FINAL] = VT(ACT_CSIDISPATCH, ESC_GROUND),
+		[CLS_PRINT] = VT(ACT_NONE, ESC_CSI_IGNORE),
+	},
+	[ESC_CSI_IGNORE] = {
+		VTANYWHERE(ESC_CSI_IGNORE),
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_NONE, ESC_CSI_IGNORE),
+		[CLS_CSI ... CLS_FINAL] = VT(ACT_NONE, ESC_GROUND),
+	},
+	/*
+	 * A string uses all following characters until it receives
+	 * a BEL, an ESC, a CAN, a SUB or any C1 control character.
+	 */
+	[ESC_STR] = {
+		[CLS_C0 ... CLS_PRINT] = VT(ACT_STRPUT, ESC_STR),
+		[CLS_BEL] = VT(ACT_STRDISPATCH, ESC_GROUND),
+		[CLS_CAN] = VT(ACT_EXECUTE, ESC_GROUND),
+		[CLS_ESC] = VT(ACT_CLEAR, ESC_STR_ESC),
+		[CLS_C1] = VT(ACT_EXECUTE, ESC_GROUND),
+	},
+	[ESC_STR_ESC] = {
+		VTANYWHERE(ESC_STR_ESC),
+		[CLS_BEL] = VT(ACT_STRDISPATCH, ESC_GROUND), /* xterm */
+		[CLS_INTER ... CLS_PRINT] = VT(ACT_ESCDISPATCH, ESC_GROUND),
+		[CLS_HASH] = VT(ACT_NONE, ESC_TEST),
+		[CLS_PERCENT] = VT(ACT_NONE, ESC_UTF8),
+		[CLS_CHARSET] = VT(ACT_CHARSET, ESC_CHARSET),
+		[CLS_CSI] = VT(ACT_NONE, ESC_CSI_ENTRY),
+		[CLS_ST] = VT(ACT_STRDISPATCH, ESC_GROUND),
+		[CLS_STR] = VT(ACT_STRSTART, ESC_STR),
+	},
+};
+
 void
-tputc(Rune u)
+strput(Rune u)
 {
 	char c[UTF_SIZ];
-	int control;
-	int width, len;
-	Glyph *gp;
+	int len;
 
-	control = ISCONTROL(u);
 	if (u < 127 || !IS_SET(MODE_UTF8)) {
 		c[0] = u;
-		width = len = 1;
+		len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1)
-			width = 1;
 	}
 
-	if (IS_SET(MODE_PRINT))
-		tprinter(c, len);
+	if (strescseq.len+len >= strescseq.siz) {
+		/*
+		 * Here is a bug in terminals. If the user never sends
+		 * some code to stop the str or esc command, then st
+		 * will stop responding. But this is better than
+		 * silently failing with unknown characters. At least
+		 * then users will report back.
+		 *
+		 * In the case users ever get fixed, here is the code:
+		 */
+		/*
+		 * term.esc = ESC_GROUND;
+		 * strhandle();
+		 */
+		if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
+			return;
+		strescseq.siz *= 2;
+		strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
+	}
 
-	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		   ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START|ESC_STR);
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
-		}
+	memmove(&strescseq.buf[strescseq.len], c, len);
+	strescseq.len += len;
+}
 
-		if (strescseq.len+len >= strescseq.siz) {
-			/*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term.esc = 0;
-			 * strhandle();
-			 */
-			if (strescseq.siz > (SIZE_MAX - UTF_SIZ) / 2)
-				return;
-			strescseq.siz *= 2;
-			strescseq.buf = xrealloc(strescseq.buf, strescseq.siz);
-		}
+void
+tputc(Rune u)
+{
+	char c[UTF_SIZ];
+	int len;
+	uchar trans;
 
-		memmove(&strescseq.buf[strescseq.len], c, len);
-		strescseq.len += len;
-		return;
+	if (IS_SET(MODE_PRINT)) {
+		if (u < 127 || !IS_SET(MODE_UTF8)) {
+			c[0] = u;
+			len = 1;
+		} else {
+			len = utf8encode(u, c);
+		}
+		tprinter(c, len);
 	}
 
-check_control_code:
-	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
-	 */
-	if (control) {
+	if (u < 0x80)
+		trans = vttable[term.esc][vtclass[u]];
+	else
+		trans = vttable[term.esc][ISCONTROLC1(u) ? CLS_C1 : CLS_PRINT];
+	term.esc = trans & 0xf;
+
+	switch (trans >> 4) {
+	case ACT_NONE:
+		break;
+	case ACT_PRINT:
+		tputglyph(u);
+		break;
+	case ACT_EXECUTE:
+		/*
+		 * Actions of control codes must be performed as soon they
+		 * arrive because they can be embedded inside a control
+		 * sequence, and they must not cause conflicts with sequences.
+		 */
 		/* in UTF-8 mode ignore handling C1 control characters */
 		if (IS_SET(MODE_UTF8) && ISCONTROLC1(u))
-			return;
+			break;
 		tcontrolcode(u);
 		/*
 		 * control codes are not shown ever
 		 */
-		if (!term.esc)
+		if (term.esc == ESC_GROUND)
 			term.lastc = 0;
-		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
-		} else if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
-		} else {
-			if (!eschandle(u))
-				return;
-			/* sequence already finished */
-		}
-		term.esc = 0;
-		/*
-		 * All characters which form part of a sequence are not
-		 * printed
-		 */
-		return;
+		break;
+	case ACT_CLEAR:
+		csireset();
+		break;
+	case ACT_ESCDISPATCH:
+		eschandle(u);
+		break;
+	case ACT_CHARSET:
+		term.icharset = u - '(';
+		break;
+	case ACT_DEFTRAN:
+		tdeftran(u);
+		break;
+	case ACT_DECTEST:
+		tdectest(u);
+		break;
+	case ACT_DEFUTF8:
+		tdefutf8(u);
+		break;
+	case ACT_CSICOLLECT:
+		csicollect(u);
+		break;
+	case ACT_CSIDISPATCH:
+		csiescseq.mode = u;
+		csihandle();
+		break;
+	case ACT_STRSTART:
+		tstrsequence(u);
+		break;
+	case ACT_STRPUT:
+		strput(u);
+		break;
+	case ACT_STRDISPATCH:
+		strhandle();
+		/* BEL and C1 ST are control codes, ESC \ is a sequence */
+		if (ISCONTROL(u))
+			term.lastc = 0;
+		break;
 	}
-	/* selected() takes relative coordinates */
-	if (selected(term.c.x + term.scr, term.c.y + term.scr))
+}
+
+void
+tputglyph(Rune u)
+{
+	int width;
+	Cell *gp;
+	Glyph attr = term.c.attr;
+
+	width = (u < 127 || !IS_SET(MODE_UTF8)) ? 1 : runewidth(u);
+
+	/* regionselected() takes relative coordinates */
+	if (regionselected(term.c.x + term.scr, term.c.y + term.scr,
+	                   term.c.x + term.scr, term.c.y + term.scr))
 		selclear();
 
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		tlinefill(term.line[term.c.y], term.c.x + 1);
+		tcellmode(gp, ATTR_WRAP, 0);
+		tlinewiden(term.line[term.c.y], term.c.x, ATTR_WRAP);
 		tnewline(1);
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
 	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
-		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
-		gp->mode &= ~ATTR_WIDE;
+		tlinefill(term.line[term.c.y], term.col);
+		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Cell));
+		tcellmode(gp, 0, ATTR_WIDE);
+		LMETA(term.line[term.c.y])->len =
+			MIN(LMETA(term.line[term.c.y])->len + width, term.col);
 	}
 
 	if (term.c.x+width > term.col) {
@@ -2789,18 +5069,21 @@ check_control_code:
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
-	tsetchar(u, &term.c.attr, term.c.x, term.c.y);
+	if (width == 2)
+		attr.mode |= ATTR_WIDE;
+	tsetchar(u, &attr, term.c.x, term.c.y);
 	term.lastc = u;
 
 	if (width == 2) {
-		gp->mode |= ATTR_WIDE;
 		if (term.c.x+1 < term.col) {
-			if (gp[1].mode == ATTR_WIDE && term.c.x+2 < term.col) {
+			tlinefill(term.line[term.c.y], term.c.x + 2);
+			if (CMODE(gp[1]) == ATTR_WIDE && term.c.x+2 < term.col) {
 				gp[2].u = ' ';
-				gp[2].mode &= ~ATTR_WDUMMY;
+				tcellmode(&gp[2], 0, ATTR_WDUMMY);
 			}
 			gp[1].u = '\0';
-			gp[1].mode = ATTR_WDUMMY;
+			tcellmode(&gp[1], ATTR_WDUMMY, ~0);
+			tlinewiden(term.line[term.c.y], term.c.x+1, ATTR_WDUMMY);
 		}
 	}
 	if (term.c.x+width < term.col) {
@@ -2811,166 +5094,358 @@ check_control_code:
 	}
 }
 
+/*
+ * Fast path of tputc() for a run of printable ASCII outside of any
+ * sequence: the run is stored a line span at a time with the current
+ * attributes, instead of going through the control and escape checks
+ * once per character.
+ */
+void
+tputascii(const Rune *s, int n)
+{
+	Cell *line, *gp, *end, *real;
+	uint32_t st;
+	char c[64];
+	int len, i;
+
+	if (IS_SET(MODE_PRINT)) {
+		for (len = 0; len < n; len += i) {
+			for (i = 0; i < LEN(c) && len + i < n; i++)
+				c[i] = s[len + i];
+			tprinter(c, i);
+		}
+	}
+
+	st = tintern(term.c.attr.mode | ATTR_SET, term.c.attr.fg,
+	             term.c.attr.bg);
+	while (n > 0) {
+		if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			/* regionselected() takes relative coordinates */
+			if (regionselected(term.c.x + term.scr, term.c.y + term.scr,
+			                   term.c.x + term.scr, term.c.y + term.scr))
+				selclear();
+			tlinefill(term.line[term.c.y], term.c.x + 1);
+			tcellmode(&term.line[term.c.y][term.c.x], ATTR_WRAP, 0);
+			tlinewiden(term.line[term.c.y], term.c.x, ATTR_WRAP);
+			tnewline(1);
+		}
+
+		len = MIN(n, term.col - term.c.x);
+		if (regionselected(term.c.x + term.scr, term.c.y + term.scr,
+		                   term.c.x + len - 1 + term.scr, term.c.y + term.scr))
+			selclear();
+
+		/* blanks still pending are no halves of wide characters */
+		line = tlinefill(term.line[term.c.y], term.c.x);
+		gp = &line[term.c.x];
+		end = gp + len;
+		real = line + MIN(LMETA(line)->clr, term.col);
+		for (; gp < MIN(end, real); gp++) {
+			if (CMODE(*gp) & ATTR_WIDE) {
+				if (gp + 1 < real) {
+					gp[1].u = ' ';
+					tcellmode(&gp[1], 0, ATTR_WDUMMY);
+				}
+			} else if ((CMODE(*gp) & ATTR_WDUMMY) && gp > line) {
+				gp[-1].u = ' ';
+				tcellmode(&gp[-1], 0, ATTR_WIDE);
+			}
+			gp->u = *s++;
+			gp->s = st;
+		}
+		for (; gp < end; gp++) {
+			gp->u = *s++;
+			gp->s = st;
+		}
+		tlinetake(line, term.c.x, term.c.x + len - 1);
+		tlinewiden(line, term.c.x + len - 1, term.styles.s[st].mode);
+		term.dirty[term.c.y] = 1;
+		term.lastc = s[-1];
+		n -= len;
+
+		if (term.c.x + len < term.col) {
+			tmoveto(term.c.x + len, term.c.y);
+		} else {
+			term.c.x = term.col - 1;
+			term.wrapcwidth[IS_SET(MODE_ALTSCREEN)] = 1;
+			term.c.state |= CURSOR_WRAPNEXT;
+			/* without autowrap the rest overwrites the last column */
+			if (n > 1 && !IS_SET(MODE_WRAP)) {
+				s += n - 1;
+				n = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Returns the length of the run of printable ASCII (0x20 - 0x7e) at the
+ * start of u, 4 runes at a time where SSE2 is available.
+ */
+int
+tasciilen(const Rune *u, int ulen)
+{
+	int n = 0;
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi32(0x1f), hi = _mm_set1_epi32(0x7f);
+	__m128i v;
+	int mask;
+
+	for (; n + 4 <= ulen; n += 4) {
+		v = _mm_loadu_si128((const __m128i *)(u + n));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(
+			_mm_cmpgt_epi32(v, lo), _mm_cmplt_epi32(v, hi))));
+		if (mask != 0xf)
+			return n + __builtin_ctz(~mask);
+	}
+#endif
+	for (; n < ulen && BETWEEN(u[n], 0x20, 0x7e); n++)
+		;
+
+	return n;
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
-	int charsize;
-	Rune u;
-	int n;
+	Rune runes[RUNE_BUF_SIZ], u;
+	size_t nr;
+	int charsize, utf8;
+	int i, n, len;
+
+	if (term.styles.n >= term.styles.gc)
+		tstylegc();
 
 	for (n = 0; n < buflen; n += charsize) {
-		if (IS_SET(MODE_UTF8)) {
-			/* process a complete utf8 char */
-			charsize = utf8decode(buf + n, &u, buflen - n);
-			if (charsize == 0)
+		/* decode as much as possible at once */
+		utf8 = IS_SET(MODE_UTF8);
+		if (utf8) {
+			nr = LEN(runes);
+			charsize = utf8decodebuf(buf + n, buflen - n, runes, &nr);
+			if (nr == 0)
 				break;
 		} else {
-			u = buf[n] & 0xFF;
-			charsize = 1;
+			nr = charsize = MIN(buflen - n, LEN(runes));
+			for (i = 0; i < nr; i++)
+				runes[i] = buf[n + i] & 0xFF;
 		}
-		if (show_ctrl && ISCONTROL(u)) {
-			if (u & 0x80) {
-				u &= 0x7f;
-				tputc('^');
-				tputc('[');
-			} else if (u != '\n' && u != '\r' && u != '\t') {
-				u ^= 0x40;
-				tputc('^');
+
+		for (i = 0; i < nr; i += len) {
+			if (term.esc == ESC_GROUND &&
+			    BETWEEN(runes[i], 0x20, 0x7e) &&
+			    !IS_SET(MODE_INSERT) &&
+			    term.trantbl[term.charset] != CS_GRAPHIC0) {
+				len = tasciilen(runes + i, nr - i);
+				tputascii(runes + i, len);
+				continue;
+			}
+			len = 1;
+			u = runes[i];
+			if (show_ctrl && ISCONTROL(u)) {
+				if (u & 0x80) {
+					u &= 0x7f;
+					tputc('^');
+					tputc('[');
+				} else if (u != '\n' && u != '\r' && u != '\t') {
+					u ^= 0x40;
+					tputc('^');
+				}
+			}
+			tputc(u);
+
+			/* the rest was decoded for the wrong mode */
+			if (IS_SET(MODE_UTF8) != utf8 && i + 1 < nr) {
+				if (!utf8) {
+					charsize = i + 1;
+				} else {
+					for (charsize = 0; i >= 0; i--)
+						charsize += utf8decode(buf + n + charsize,
+						                       &u, buflen - n - charsize);
+				}
+				break;
 			}
 		}
-		tputc(u);
 	}
 	return n;
 }
 
+/*
+ * Rewraps the lines of the screen and the newest lines of history, as
+ * many as it takes to fill the new screen. Older lines keep the width
+ * they were wrapped at, in term.seg, until thistrewrap() gets to them.
+ * A resize then costs about the same however long the history is.
+ */
 void
 treflow(int col, int row)
 {
 	int i, j;
-	int oce, nce, bot, scr;
-	int ox = 0, oy = -term.histf, nx = 0, ny = -1, len;
-	int cy = -1; /* proxy for new y coordinate of cursor */
-	int nlines;
-	Line *buf, line;
+	int oce, nce, bot, scr, top, n, l, len;
+	int ny, cy = -1; /* proxy for new y coordinate of cursor */
+	Cell **buf, **ring;
+
+	/*
+	 * the cursor may come back from the alt screen, resized meanwhile,
+	 * beyond the lines being reflowed
+	 */
+	if (term.c.x >= term.col) {
+		term.c.state &= ~CURSOR_WRAPNEXT;
+		term.c.x = term.col - 1;
+	}
+	term.c.y = MIN(term.c.y, term.row - 1);
 
 	/* y coordinate of cursor line end */
 	for (oce = term.c.y; oce < term.row - 1 &&
 	                     tiswrapped(term.line[oce]); oce++);
 
-	nlines = term.histf + oce + 1;
-	if (col < term.col) {
-		/* each line can take this many lines after reflow */
-		j = (term.col + col - 1) / col;
-		nlines = j * nlines;
-		if (nlines > HISTSIZE + RESIZEBUFFER + row) {
-			nlines = HISTSIZE + RESIZEBUFFER + row;
-			oy = -(nlines / j - oce - 1);
+	/* the start of a logical line with a new screen of rows below it */
+	for (top = 0, n = l = 0; n < row && top > -term.histf; ) {
+		treflowline(--top, &len);
+		l += len;
+		if (top > -term.histf && thistwrapped(1 - top))
+			continue;
+		n += MAX((l + col - 1) / col, 1);
+		l = 0;
+	}
+	buf = treflowlines(top, oce, col, &ny, &cy);
+	ny--;
+
+	/* the new grid, blank below the cursor line end */
+	ring = xmalloc(2 * row * sizeof(Cell *));
+	tslabnew(ring, col, row);
+
+	bot = MIN(ny, row - 1);
+	scr = MAX(row - term.row, 0);
+	/* update y coordinate of cursor line end */
+	nce = MIN(oce + scr, bot);
+	/* update cursor y coordinate */
+	term.c.y = nce - (ny - cy);
+	if (term.c.y < 0) {
+		j = nce, nce = MIN(nce + -term.c.y, bot);
+		term.c.y += nce - j;
+		while (term.c.y < 0) {
+			trowfree(buf[ny--]);
+			term.c.y++;
 		}
 	}
-	buf = xmalloc(nlines * sizeof(Line));
+	/* fill visible area */
+	for (i = nce; i >= 0; i--, ny--) {
+		trowcopy(ring[i], buf[ny], col, col);
+		trowfree(buf[ny]);
+	}
+	free(term.ring);
+	term.line = term.ring = ring;
+	tslabdone();
+	/* the rest replaces the lines of history it came from */
+	while (term.histh < -top)
+		tcoldthaw();
+	for (i = top; i < 0; i++)
+		thistfree(thistpop());
+	tsegadd(term.histr, term.col);
+	term.histr = 0;
+	for (i = 0; i <= ny; i++) {
+		thistpush(thistpack(buf[i], col), trowwrapped(buf[i], col));
+		trowfree(buf[i]);
+	}
+	free(buf);
+	thistflush();
+	tcoldkick();
+	tbudget();
+}
+
+/* returns line oy as it was wrapped, of len cells */
+const Cell *
+treflowline(int oy, int *len)
+{
+	const Cell *line;
+	int age = -oy, i;
+
+	if (age <= term.histr) {
+		line = TLINEABS(oy);
+		*len = tlinelen(line);
+		return line;
+	}
+	for (i = 0, age -= term.histr; age > term.seg[i].n; age -= term.seg[i++].n)
+		;
+	line = thistrow(-oy, term.seg[i].col);
+	*len = trowlen(line, term.seg[i].col);
+	return line;
+}
+
+/*
+ * Rewraps the lines from oy to oe, which ends a logical line, into n
+ * new rows of col cells. If the cursor is on one of them, it moves
+ * along to row cy.
+ */
+Cell **
+treflowlines(int oy, int oe, int col, int *n, int *cy)
+{
+	int j, ox = 0, nx = 0, ny = -1, len, siz = 64;
+	Cell **buf;
+	const Cell *line;
+
+	buf = xmalloc(siz * sizeof(Cell *));
 	do {
-		if (!nx)
-			buf[++ny] = xmalloc(col * sizeof(Glyph));
-		if (!ox) {
-			line = TLINEABS(oy);
-			len = tlinelen(line);
+		if (!nx) {
+			if (++ny == siz)
+				buf = xrealloc(buf, (siz *= 2) * sizeof(Cell *));
+			buf[ny] = trowalloc(col);
 		}
+		if (!ox)
+			line = treflowline(oy, &len);
 		if (oy == term.c.y) {
 			if (!ox)
 				len = MAX(len, term.c.x + 1);
 			/* update cursor */
-			if (cy < 0 && term.c.x - ox < col - nx) {
-				term.c.x = nx + term.c.x - ox, cy = ny;
+			if (*cy < 0 && term.c.x - ox < col - nx) {
+				term.c.x = nx + term.c.x - ox, *cy = ny;
 				UPDATEWRAPNEXT(0, col);
 			}
 		}
 		/* get reflowed lines in buf */
 		if (col - nx > len - ox) {
-			memcpy(&buf[ny][nx], &line[ox], (len-ox) * sizeof(Glyph));
+			memcpy(&buf[ny][nx], &line[ox], (len-ox) * sizeof(Cell));
 			nx += len - ox;
-			if (len == 0 || !(line[len - 1].mode & ATTR_WRAP)) {
+			if (len == 0 || !(CMODE(line[len - 1]) & ATTR_WRAP)) {
 				for (j = nx; j < col; j++)
 					tclearglyph(&buf[ny][j], 0);
 				nx = 0;
 			} else if (nx > 0) {
-				buf[ny][nx - 1].mode &= ~ATTR_WRAP;
+				tcellmode(&buf[ny][nx - 1], 0, ATTR_WRAP);
 			}
 			ox = 0, oy++;
 		} else if (col - nx == len - ox) {
-			memcpy(&buf[ny][nx], &line[ox], (col-nx) * sizeof(Glyph));
+			memcpy(&buf[ny][nx], &line[ox], (col-nx) * sizeof(Cell));
 			ox = 0, oy++, nx = 0;
 		} else/* if (col - nx < len - ox) */ {
-			memcpy(&buf[ny][nx], &line[ox], (col-nx) * sizeof(Glyph));
-    	ox += col - nx;
-			buf[ny][col - 1].mode |= ATTR_WRAP;
+			memcpy(&buf[ny][nx], &line[ox], (col-nx) * sizeof(Cell));
+			ox += col - nx;
+			tcellmode(&buf[ny][col - 1], ATTR_WRAP, 0);
 			nx = 0;
 		}
-	} while (oy <= oce);
+	} while (oy <= oe);
 	if (nx)
 		for (j = nx; j < col; j++)
 			tclearglyph(&buf[ny][j], 0);
-
-	/* free extra lines */
-	for (i = row; i < term.row; i++)
-		free(term.line[i]);
-	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-
-	bot = MIN(ny, row - 1);
-	scr = MAX(row - term.row, 0);
-	/* update y coordinate of cursor line end */
-	nce = MIN(oce + scr, bot);
-	/* update cursor y coordinate */
-	term.c.y = nce - (ny - cy);
-	if (term.c.y < 0) {
-		j = nce, nce = MIN(nce + -term.c.y, bot);
-		term.c.y += nce - j;
-		while (term.c.y < 0) {
-			free(buf[ny--]);
-			term.c.y++;
-		}
-	}
-	/* allocate new rows */
-	for (i = row - 1; i > nce; i--) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		for (j = 0; j < col; j++)
-			tclearglyph(&term.line[i][j], 0);
-	}
-	/* fill visible area */
-	for (/*i = nce */; i >= term.row; i--, ny--)
-		term.line[i] = buf[ny];
-	for (/*i = term.row - 1 */; i >= 0; i--, ny--) {
-		free(term.line[i]);
-		term.line[i] = buf[ny];
-	}
-	/* fill lines in history buffer and update term.histf */
-	for (/*i = -1 */; ny >= 0 && i >= -HISTSIZE; i--, ny--) {
-		j = (term.histi + i + 1 + HISTSIZE) % HISTSIZE;
-		free(term.hist[j]);
-		term.hist[j] = buf[ny];
-	}
-	term.histf = -i - 1;
-	term.scr = MIN(term.scr, term.histf);
-	/* resize rest of the history lines */
-	for (/*i = -term.histf - 1 */; i >= -HISTSIZE; i--) {
-		j = (term.histi + i + 1 + HISTSIZE) % HISTSIZE;
-		term.hist[j] = xrealloc(term.hist[j], col * sizeof(Glyph));
-	}
-	free(buf);
+	*n = ny + 1;
+	return buf;
 }
 
 void
 rscrolldown(int n)
 {
 	int i;
-	Line temp;
+	Cell *temp;
+	HistLine *h;
 
 	/* can never be true as of now
 	if (IS_SET(MODE_ALTSCREEN))
 		return; */
 
+	thistrewrap(n);
 	if ((n = MIN(n, term.histf)) <= 0)
 		return;
+	while (term.histh < n)
+		tcoldthaw();
 
 	for (i = term.c.y + n; i >= n; i--) {
 		temp = term.line[i];
@@ -2978,13 +5453,12 @@ rscrolldown(int n)
 		term.line[i-n] = temp;
 	}
 	for (/*i = n - 1 */; i >= 0; i--) {
-		temp = term.line[i];
-		term.line[i] = term.hist[term.histi];
-		term.hist[term.histi] = temp;
-		term.histi = (term.histi - 1 + HISTSIZE) % HISTSIZE;
+		h = thistpop();
+		thistunpack(term.line[i], h, term.col);
+		thistfree(h);
 	}
+	thistflush();
 	term.c.y += n;
-	term.histf -= n;
 	if ((i = term.scr - n) >= 0) {
 		term.scr = i;
 	} else {
@@ -3025,8 +5499,6 @@ tresize(int col, int row)
 void
 tresizedef(int col, int row)
 {
-	int i, j;
-
 	/* return if dimensions haven't changed */
 	if (term.col == col && term.row == row) {
 		tfulldirt();
@@ -3042,22 +5514,17 @@ tresizedef(int col, int row)
 			tscrollup(0, term.row - 1, term.c.y - row + 1, SCROLL_RESIZE);
 			term.c.y = row - 1;
 		}
-		for (i = row; i < term.row; i++)
-			free(term.line[i]);
-
 		/* resize to new height */
-		term.line = xrealloc(term.line, row * sizeof(Line));
-		/* allocate any new rows */
-		for (i = term.row; i < row; i++) {
-			term.line[i] = xmalloc(col * sizeof(Glyph));
-			for (j = 0; j < col; j++)
-				tclearglyph(&term.line[i][j], 0);
-		}
+		tregrid(0, col, row);
 		/* scroll down as much as height has increased */
 		rscrolldown(row - term.row);
 	}
 	/* update terminal size */
 	term.col = col, term.row = row;
+	tmirror();
+	/* the lines scrolled back to are rewrapped as well */
+	thistrewrap(term.scr);
+	term.scr = MIN(term.scr, term.histf);
 	/* reset scrolling region */
 	term.top = 0, term.bot = row - 1;
 	/* dirty all lines */
@@ -3067,7 +5534,7 @@ tresizedef(int col, int row)
 void
 tresizealt(int col, int row)
 {
-	int i, j;
+	int i;
 
 	/* return if dimensions haven't changed */
 	if (term.col == col && term.row == row) {
@@ -3077,29 +5544,10 @@ tresizealt(int col, int row)
 	if (sel.alt)
 		selremove();
 	/* slide screen up if otherwise cursor would get out of the screen */
-	for (i = 0; i <= term.c.y - row; i++)
-		free(term.line[i]);
-	if (i > 0) {
-		/* ensure that both src and dst are not NULL */
-		memmove(term.line, term.line + i, row * sizeof(Line));
+	i = MAX(term.c.y - row + 1, 0);
+	tregrid(i, col, row);
+	if (i > 0)
 		term.c.y = row - 1;
-	}
-	for (i += row; i < term.row; i++)
-		free(term.line[i]);
-	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	/* resize to new width */
-	for (i = 0; i < MIN(row, term.row); i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		for (j = term.col; j < col; j++)
-			tclearglyph(&term.line[i][j], 0);
-	}
-	/* allocate any new rows */
-	for (/*i = MIN(row, term.row) */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		for (j = 0; j < col; j++)
-			tclearglyph(&term.line[i][j], 0);
-	}
 	/* update cursor */
 	if (term.c.x >= col) {
 		term.c.state &= ~CURSOR_WRAPNEXT;
@@ -3109,6 +5557,7 @@ tresizealt(int col, int row)
 	}
 	/* update terminal size */
 	term.col = col, term.row = row;
+	tmirror();
 	/* reset scrolling region */
 	term.top = 0, term.bot = row - 1;
 	/* dirty all lines */
@@ -3127,44 +5576,98 @@ drawregion(int x1, int y1, int x2, int y2)
 	int y;
 
 	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y])
+		if (!frame.dirty[y])
 			continue;
 
-		term.dirty[y] = 0;
-		xdrawline(TLINE(y), x1, y, x2);
+		frame.dirty[y] = 0;
+		xdrawline(frame.line[y], x1, y, x2);
 	}
 }
 
+/*
+ * Copies what the next frame needs out of term and clears term.dirty.
+ * Must be called with termlock held.
+ */
 void
-draw(void)
+tsnapshot(void)
 {
-	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
+	int y, cx = term.c.x;
 
-	if (!xstartdraw())
-		return;
+	if (frame.row != term.row || frame.col != term.col) {
+		for (y = 0; y < frame.row; y++)
+			free(frame.line[y]);
+		frame.line = xrealloc(frame.line, term.row * sizeof(Line));
+		frame.dirty = xrealloc(frame.dirty, term.row * sizeof(*frame.dirty));
+		for (y = 0; y < term.row; y++)
+			frame.line[y] = xmalloc(term.col * sizeof(Glyph));
+		frame.oline = xrealloc(frame.oline, term.col * sizeof(Glyph));
+		frame.row = term.row;
+		frame.col = term.col;
+	}
 
 	/* adjust cursor position */
 	LIMIT(term.ocx, 0, term.col-1);
 	LIMIT(term.ocy, 0, term.row-1);
-	if (term.line[term.ocy][term.ocx].mode & ATTR_WDUMMY)
+	tlinefill(term.line[term.ocy], term.ocx + 1);
+	tlinefill(term.line[term.c.y], cx + 1);
+	if (CMODE(term.line[term.ocy][term.ocx]) & ATTR_WDUMMY)
 		term.ocx--;
-	if (term.line[term.c.y][cx].mode & ATTR_WDUMMY)
+	if (CMODE(term.line[term.c.y][cx]) & ATTR_WDUMMY)
 		cx--;
 
-	drawregion(0, 0, term.col, term.row);
-	xdrawcursor(cx, term.c.y, term.line[term.c.y][cx],
-			term.ocx, term.ocy, term.line[term.ocy][term.ocx],
-			term.line[term.ocy], term.col);
+	for (y = 0; y < term.row; y++) {
+		if (!(frame.dirty[y] = term.dirty[y]))
+			continue;
+		term.dirty[y] = 0;
+		if (y < term.scr)
+			tunpack(frame.line[y], thistline(term.scr - y), term.col);
+		else
+			tunpackrow(frame.line[y], term.line[y - term.scr]);
+	}
+	tunpackrow(frame.oline, term.line[term.ocy]);
+
+	frame.cx = cx;
+	frame.cy = term.c.y;
+	tunpack(&frame.cg, &term.line[term.c.y][cx], 1);
+	frame.ocx = term.ocx;
+	frame.ocy = term.ocy;
+	tunpack(&frame.og, &term.line[term.ocy][term.ocx], 1);
+	frame.sel = sel;
+	frame.alt = IS_SET(MODE_ALTSCREEN);
+
 	term.ocx = cx;
 	term.ocy = term.c.y;
+}
+
+void
+draw(void)
+{
+	int ocx, ocy;
+
+	tlock();
+	if (!xstartdraw()) {
+		tunlock();
+		return;
+	}
+	ocx = term.ocx;
+	ocy = term.ocy;
+	tsnapshot();
+	tunlock();
+
+	drawregion(0, 0, frame.col, frame.row);
+	xdrawcursor(frame.cx, frame.cy, frame.cg,
+			frame.ocx, frame.ocy, frame.og,
+			frame.oline, frame.col);
 	xfinishdraw();
-	if (ocx != term.ocx || ocy != term.ocy)
-		xximspot(term.ocx, term.ocy);
+	if (ocx != frame.cx || ocy != frame.cy)
+		xximspot(frame.cx, frame.cy);
 }
 
 void
 redraw(void)
 {
+	tlock();
 	tfulldirt();
+	tunlock();
 	draw();
 }
@@ -3,8 +3,10 @@
 #include <math.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -111,6 +113,41 @@ int allowwindowops = 0;
 static double minlatency = 8;
 static double maxlatency = 33;
 
+/*
+ * most bytes read from the tty and parsed per wakeup, before going back to
+ * the event loop. the tty is drained until it is empty or this is reached,
+ * so a fast producer can't starve input and drawing. 0 means no limit.
+ */
+unsigned int ttyreadmax = 256 * 1024;
+
+/*
+ * lines of scrollback. they are only allocated as they scroll off the
+ * screen, so a large value costs nothing until it is used. can be
+ * overridden with -s.
+ */
+unsigned int histsize = 2000;
+
+/*
+ * lines of scrollback kept as they are. older lines are compressed in the
+ * background and expanded again when scrolled to, selected or piped.
+ */
+unsigned int histhot = 1000;
+
+/*
+ * 1 writes compressed scrollback to files in $XDG_RUNTIME_DIR instead of
+ * keeping it in memory, so histsize is bounded by the disk rather than by
+ * ram. the files are unlinked as soon as they are made. can be set with -S.
+ */
+int histspill = 0;
+
+/*
+ * KiB the screens, scrollback and escape buffers of a terminal may take,
+ * 0 for no limit. past it the oldest scrollback is compressed, then
+ * dropped. Ctrl-Shift-m prints what is used to stderr. can be overridden
+ * with -m.
+ */
+unsigned int membudget = 0;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -277,6 +314,7 @@ static Shortcut shortcuts[] = {
     {TERMMOD,     XK_Y,        selpaste,      {.i = 0}         },
     {ShiftMask,   XK_Insert,   selpaste,      {.i = 0}         },
     {TERMMOD,     XK_Num_Lock, numlock,       {.i = 0}         },
+    {TERMMOD,     XK_M,        memreport,     {.i = 0}         },
     // {ShiftMask, XK_Page_Up, kscrollup, {.i = -1}},
     // {ShiftMask, XK_Page_Down, kscrolldown, {.i = -1}},
 };
@@ -1099,6 +1137,7 @@ typedef XftGlyphFontSpec GlyphFontSpec;
 /* Purely graphic info */
 typedef struct {
     int tw, th; /* tty width and height */
+    int col, row; /* tty columns and rows */
     int w, h;   /* window width and height */
     int hborderpx, vborderpx;
     int ch;     /* char height */
@@ -1112,6 +1151,8 @@ typedef struct {
     Colormap cmap;
     Window win;
     Drawable buf;
+    int bufw, bufh; /* allocated size of buf, at least the window's */
+    int rw, rh;     /* size from the last ConfigureNotify, 0 once applied */
     GlyphFontSpec *specbuf; /* font spec buffer used for rendering */
     Atom xembed, wmdeletewin, netwmname, netwmiconname, netwmpid;
     struct {
@@ -1208,6 +1249,7 @@ static char *kmap(KeySym, uint);
 static int match(uint, uint);
 
 static void run(void);
+static void settimer(int, double, double);
 static void usage(void);
 
 static void (*handler[LASTEvent])(XEvent *) = {
@@ -1242,6 +1284,12 @@ static XWindow xw;
 static XSelection xsel;
 static TermWindow win;
 
+/*
+ * The win.h callbacks are also called from the tty thread. xlock keeps
+ * them, and the Xlib calls they make, apart from drawing a frame.
+ */
+static pthread_mutex_t xlock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Font Ring Cache */
 enum { FRC_NORMAL, FRC_ITALIC, FRC_BOLD, FRC_ITALICBOLD };
 
@@ -1574,7 +1622,9 @@ void selnotify(XEvent *e) {
 }
 
 void xclipcopy(void) {
+    pthread_mutex_lock(&xlock);
     clipcopy(NULL);
+    pthread_mutex_unlock(&xlock);
 }
 
 void selclear_(XEvent *e) {
@@ -1643,7 +1693,9 @@ void setsel(char *str, Time t) {
 }
 
 void xsetsel(char *str) {
+    pthread_mutex_lock(&xlock);
     setsel(str, CurrentTime);
+    pthread_mutex_unlock(&xlock);
 }
 
 void brelease(XEvent *e) {
@@ -1673,7 +1725,7 @@ void bmotion(XEvent *e) {
 }
 
 void cresize(int width, int height) {
-    int col, row;
+    int col, row, ocol = win.col, orow = win.row, tw = win.tw, th = win.th;
 
     if (width != 0)
         win.w = width;
@@ -1690,16 +1742,32 @@ void cresize(int width, int height) {
 
     tresize(col, row);
     xresize(col, row);
-    ttyresize(win.tw, win.th);
+    /*
+     * every TIOCSWINSZ makes the shell redraw its prompt; a zoom can
+     * change the cells while their product in pixels stays the same
+     */
+    if (col != ocol || row != orow || win.tw != tw || win.th != th)
+        ttyresize(win.tw, win.th);
 }
 
 void xresize(int col, int row) {
+    win.col = col;
+    win.row = row;
     win.tw = col * win.cw;
     win.th = row * win.ch;
 
-    XFreePixmap(xw.dpy, xw.buf);
-    xw.buf = XCreatePixmap(xw.dpy, xw.win, win.w, win.h, xw.depth);
-    XftDrawChange(xw.draw, xw.buf);
+    /*
+     * A drag changes the size by a few pixels at a time. Keep the pixmap
+     * while the window fits and does not waste most of it, and leave
+     * some slack when it has to grow.
+     */
+    if (win.w > xw.bufw || win.h > xw.bufh || win.w < xw.bufw / 2 || win.h < xw.bufh / 2) {
+        xw.bufw = win.w + win.w / 8;
+        xw.bufh = win.h + win.h / 8;
+        XFreePixmap(xw.dpy, xw.buf);
+        xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.bufw, xw.bufh, xw.depth);
+        XftDrawChange(xw.draw, xw.buf);
+    }
     xclear(0, 0, win.w, win.h);
 
     /* resize to new width */
@@ -1736,6 +1804,7 @@ void xloadcols(void) {
     static int loaded;
     Color *cp;
 
+    pthread_mutex_lock(&xlock);
     if (loaded) {
         for (cp = dc.col; cp < &dc.col[dc.collen]; ++cp)
             XftColorFree(xw.dpy, xw.vis, xw.cmap, cp);
@@ -1759,32 +1828,38 @@ void xloadcols(void) {
     dc.col[defaultbg].pixel &= 0x00FFFFFF;
     dc.col[defaultbg].pixel |= (unsigned char) (0xff * alpha) << 24;
     loaded = 1;
+    pthread_mutex_unlock(&xlock);
 }
 
 int xgetcolor(int x, unsigned char *r, unsigned char *g, unsigned char *b) {
     if (!BETWEEN(x, 0, dc.collen))
         return 1;
 
+    pthread_mutex_lock(&xlock);
     *r = dc.col[x].color.red >> 8;
     *g = dc.col[x].color.green >> 8;
     *b = dc.col[x].color.blue >> 8;
+    pthread_mutex_unlock(&xlock);
 
     return 0;
 }
 
 int xsetcolorname(int x, const char *name) {
     Color ncolor;
+    int ret = 1;
 
     if (!BETWEEN(x, 0, dc.collen))
         return 1;
 
-    if (!xloadcolor(x, name, &ncolor))
-        return 1;
-
-    XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
-    dc.col[x] = ncolor;
+    pthread_mutex_lock(&xlock);
+    if (xloadcolor(x, name, &ncolor)) {
+        XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
+        dc.col[x] = ncolor;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&xlock);
 
-    return 0;
+    return ret;
 }
 
 /*
@@ -2100,6 +2175,8 @@ void xinit(int cols, int rows) {
     memset(&gcvalues, 0, sizeof(gcvalues));
     gcvalues.graphics_exposures = False;
     xw.buf                      = XCreatePixmap(xw.dpy, xw.win, win.w, win.h, xw.depth);
+    xw.bufw                     = win.w;
+    xw.bufh                     = win.h;
     dc.gc                       = XCreateGC(xw.dpy, xw.buf, GCGraphicsExposures, &gcvalues);
     XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
     XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, win.w, win.h);
@@ -2498,26 +2575,37 @@ void xseticontitle(char *p) {
     XTextProperty prop;
     DEFAULT(p, opt_title);
 
-    if (Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle, &prop) != Success)
-        return;
-    XSetWMIconName(xw.dpy, xw.win, &prop);
-    XSetTextProperty(xw.dpy, xw.win, &prop, xw.netwmiconname);
-    XFree(prop.value);
+    pthread_mutex_lock(&xlock);
+    if (Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle, &prop) == Success) {
+        XSetWMIconName(xw.dpy, xw.win, &prop);
+        XSetTextProperty(xw.dpy, xw.win, &prop, xw.netwmiconname);
+        XFree(prop.value);
+    }
+    pthread_mutex_unlock(&xlock);
 }
 
 void xsettitle(char *p) {
     XTextProperty prop;
     DEFAULT(p, opt_title);
 
-    if (Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle, &prop) != Success)
-        return;
-    XSetWMName(xw.dpy, xw.win, &prop);
-    XSetTextProperty(xw.dpy, xw.win, &prop, xw.netwmname);
-    XFree(prop.value);
+    pthread_mutex_lock(&xlock);
+    if (Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle, &prop) == Success) {
+        XSetWMName(xw.dpy, xw.win, &prop);
+        XSetTextProperty(xw.dpy, xw.win, &prop, xw.netwmname);
+        XFree(prop.value);
+    }
+    pthread_mutex_unlock(&xlock);
 }
 
+/*
+ * Holds xlock from here to xfinishdraw() when there is something to draw.
+ */
 int xstartdraw(void) {
-    return IS_SET(MODE_VISIBLE);
+    pthread_mutex_lock(&xlock);
+    if (IS_SET(MODE_VISIBLE))
+        return 1;
+    pthread_mutex_unlock(&xlock);
+    return 0;
 }
 
 void xdrawline(Line line, int x1, int y1, int x2) {
@@ -2559,6 +2647,12 @@ void xdrawline(Line line, int x1, int y1, int x2) {
 void xfinishdraw(void) {
     XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w, win.h, 0, 0);
     XSetForeground(xw.dpy, dc.gc, dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg].pixel);
+    pthread_mutex_unlock(&xlock);
+}
+
+/* bytes of the font caches, not of the fonts Xft and harfbuzz keep */
+size_t xmemused(void) {
+    return frccap * sizeof(Fontcache) + hbmemused();
 }
 
 void xximspot(int x, int y) {
@@ -2568,11 +2662,17 @@ void xximspot(int x, int y) {
     xw.ime.spot.x = borderpx + x * win.cw;
     xw.ime.spot.y = borderpx + (y + 1) * win.ch;
 
+    pthread_mutex_lock(&xlock);
     XSetICValues(xw.ime.xic, XNPreeditAttributes, xw.ime.spotlist, NULL);
+    pthread_mutex_unlock(&xlock);
 }
 
 void expose(XEvent *ev) {
-    redraw();
+    /* the frame that applies a pending resize repaints everything */
+    if (xw.rw)
+        tfulldirt();
+    else
+        redraw();
 }
 
 void visibility(XEvent *ev) {
@@ -2586,21 +2686,31 @@ void unmap(XEvent *ev) {
 }
 
 void xsetpointermotion(int set) {
+    pthread_mutex_lock(&xlock);
     MODBIT(xw.attrs.event_mask, set, PointerMotionMask);
     XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+    pthread_mutex_unlock(&xlock);
 }
 
 void xsetmode(int set, unsigned int flags) {
-    int mode = win.mode;
+    int mode;
+
+    pthread_mutex_lock(&xlock);
+    mode = win.mode;
     MODBIT(win.mode, set, flags);
-    if ((win.mode & MODE_REVERSE) != (mode & MODE_REVERSE))
-        redraw();
+    mode ^= win.mode;
+    pthread_mutex_unlock(&xlock);
+    /* called with termlock held, the next frame redraws everything */
+    if (mode & MODE_REVERSE)
+        tfulldirt();
 }
 
 int xsetcursor(int cursor) {
     if (!BETWEEN(cursor, 0, 7)) /* 7: st extension */
         return 1;
+    pthread_mutex_lock(&xlock);
     win.cursor = cursor;
+    pthread_mutex_unlock(&xlock);
     return 0;
 }
 
@@ -2613,10 +2723,12 @@ void xseturgency(int add) {
 }
 
 void xbell(void) {
+    pthread_mutex_lock(&xlock);
     if (!(IS_SET(MODE_FOCUSED)))
         xseturgency(1);
     if (bellvolume)
         XkbBell(xw.dpy, xw.win, bellvolume, (Atom) NULL);
+    pthread_mutex_unlock(&xlock);
 }
 
 void focus(XEvent *ev) {
@@ -2749,19 +2861,41 @@ void cmessage(XEvent *e) {
     }
 }
 
+/*
+ * Only records the size. A resize drag sends a burst of these, run()
+ * applies the last one right before the next frame, and until then the
+ * window keeps showing the old one.
+ */
 void resize(XEvent *e) {
-    if (e->xconfigure.width == win.w && e->xconfigure.height == win.h)
-        return;
+    xw.rw = e->xconfigure.width;
+    xw.rh = e->xconfigure.height;
+}
+
+/*
+ * Arms timerfd fd to expire in ms and then every period ms, or disarms
+ * it when ms is 0.
+ */
+void settimer(int fd, double ms, double period) {
+    struct itimerspec it = {
+        .it_interval = {period / 1E3, fmod(period, 1E3) * 1E6},
+        .it_value    = {ms / 1E3, fmod(ms, 1E3) * 1E6},
+    };
 
-    cresize(e->xconfigure.width, e->xconfigure.height);
+    /* a positive timeout that rounds to zero would disarm instead */
+    if (ms > 0 && !it.it_value.tv_sec && !it.it_value.tv_nsec)
+        it.it_value.tv_nsec = 1;
+    if (timerfd_settime(fd, 0, &it, NULL) < 0)
+        die("timerfd_settime failed: %s\n", strerror(errno));
 }
 
 void run(void) {
     XEvent ev;
     int w = win.w, h = win.h;
-    fd_set rfd;
-    int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
-    struct timespec seltv, *tv, now, lastblink, trigger;
+    int xfd = XConnectionNumber(xw.dpy), ttyfd, epfd, drawfd, blinkfd;
+    int i, n, pending, ttyev, xev, drawev, blinkev, drawing, blinking;
+    struct epoll_event evs[4];
+    struct timespec now, trigger;
+    uint64_t expirations;
     double timeout;
 
     /* Waiting for window mapping */
@@ -2780,31 +2914,51 @@ void run(void) {
         }
     } while (ev.type != MapNotify);
 
-    ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
+    ttynew(opt_line, shell, opt_io, opt_cmd);
     cresize(w, h);
+    ttyfd = ttythread();
+
+    /* the draw latency deadline and the blink period are timers as well */
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        die("epoll_create1 failed: %s\n", strerror(errno));
+    if ((drawfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        die("timerfd_create failed: %s\n", strerror(errno));
+    if ((blinkfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        die("timerfd_create failed: %s\n", strerror(errno));
+    for (i = 0; i < 4; i++) {
+        evs[i].events  = EPOLLIN;
+        evs[i].data.fd = (int[]) {xfd, ttyfd, drawfd, blinkfd}[i];
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, evs[i].data.fd, &evs[i]) < 0)
+            die("epoll_ctl failed: %s\n", strerror(errno));
+    }
 
-    for (timeout = -1, drawing = 0, lastblink = (struct timespec) {0};;) {
-        FD_ZERO(&rfd);
-        FD_SET(ttyfd, &rfd);
-        FD_SET(xfd, &rfd);
-
-        if (XPending(xw.dpy))
-            timeout = 0; /* existing events might not set xfd */
-
-        seltv.tv_sec  = timeout / 1E3;
-        seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
-        tv            = timeout >= 0 ? &seltv : NULL;
+    for (drawing = blinking = 0;;) {
+        /* events already read by Xlib do not set xfd */
+        pthread_mutex_lock(&xlock);
+        pending = XEventsQueued(xw.dpy, QueuedAlready);
+        pthread_mutex_unlock(&xlock);
 
-        if (pselect(MAX(xfd, ttyfd) + 1, &rfd, NULL, NULL, tv, NULL) < 0) {
+        if ((n = epoll_wait(epfd, evs, LEN(evs), pending ? 0 : -1)) < 0) {
             if (errno == EINTR)
                 continue;
-            die("select failed: %s\n", strerror(errno));
+            die("epoll_wait failed: %s\n", strerror(errno));
         }
         clock_gettime(CLOCK_MONOTONIC, &now);
 
-        if (FD_ISSET(ttyfd, &rfd))
-            ttyread();
+        ttyev = drawev = blinkev = 0;
+        for (i = 0; i < n; i++) {
+            if (evs[i].data.fd == ttyfd) {
+                ttyclearwake();
+                ttyev = 1;
+            } else if (evs[i].data.fd == drawfd) {
+                drawev = read(drawfd, &expirations, sizeof(expirations)) > 0;
+            } else if (evs[i].data.fd == blinkfd) {
+                blinkev = read(blinkfd, &expirations, sizeof(expirations)) > 0;
+            }
+        }
 
+        /* the tty thread parses in the meantime, term is ours until tunlock() */
+        tlock();
         xev = 0;
         while (XPending(xw.dpy)) {
             xev = 1;
@@ -2814,6 +2968,7 @@ void run(void) {
             if (handler[ev.type])
                 (handler[ev.type])(&ev);
         }
+        tunlock();
 
         /*
          * To reduce flicker and tearing, when new content or event
@@ -2826,44 +2981,62 @@ void run(void) {
          * maximum latency intervals during `cat huge.txt`, and perfect
          * sync with periodic updates from animations/key-repeats/etc.
          */
-        if (FD_ISSET(ttyfd, &rfd) || xev) {
+        if (ttyev || xev) {
             if (!drawing) {
                 trigger = now;
                 drawing = 1;
             }
             timeout = (maxlatency - TIMEDIFF(now, trigger)) / maxlatency * minlatency;
-            if (timeout > 0)
+            if (timeout > 0 && !blinkev) {
+                settimer(drawfd, timeout, 0);
                 continue; /* we have time, try to find idle */
+            }
+        } else if (!drawev && !blinkev) {
+            continue;
         }
 
         /* idle detected or maxlatency exhausted -> draw */
-        timeout = -1;
+        if (drawing && !drawev)
+            settimer(drawfd, 0, 0);
+        drawing = 0;
+
+        tlock();
+        if (xw.rw) {
+            if (xw.rw != win.w || xw.rh != win.h)
+                cresize(xw.rw, xw.rh);
+            xw.rw = xw.rh = 0;
+        }
         if (blinktimeout && tattrset(ATTR_BLINK)) {
-            timeout = blinktimeout - TIMEDIFF(now, lastblink);
-            if (timeout <= 0) {
-                if (-timeout > blinktimeout) /* start visible */
-                    win.mode |= MODE_BLINK;
+            if (!blinking) { /* start visible */
+                win.mode &= ~MODE_BLINK;
+                tsetdirtattr(ATTR_BLINK);
+                settimer(blinkfd, blinktimeout, blinktimeout);
+                blinking = 1;
+            } else if (blinkev) {
                 win.mode ^= MODE_BLINK;
                 tsetdirtattr(ATTR_BLINK);
-                lastblink = now;
-                timeout   = blinktimeout;
             }
+        } else if (blinking) {
+            settimer(blinkfd, 0, 0);
+            blinking = 0;
         }
+        tunlock();
 
         draw();
+        pthread_mutex_lock(&xlock);
         XFlush(xw.dpy);
-        drawing = 0;
+        pthread_mutex_unlock(&xlock);
     }
 }
 
 void usage(void) {
-    die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
+    die("usage: %s [-aiSv] [-c class] [-f font] [-g geometry] [-m kib]"
         " [-n name] [-o file]\n"
-        "          [-T title] [-t title] [-w windowid]"
+        "          [-s lines] [-T title] [-t title] [-w windowid]"
         " [[-e] command [args ...]]\n"
-        "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+        "       %s [-aiSv] [-c class] [-f font] [-g geometry] [-m kib]"
         " [-n name] [-o file]\n"
-        "          [-T title] [-t title] [-w windowid] -l line"
+        "          [-s lines] [-T title] [-t title] [-w windowid] -l line"
         " [stty_args ...]\n",
         argv0,
         argv0);
@@ -2906,6 +3079,15 @@ int main(int argc, char *argv[]) {
         case 'n':
             opt_name = EARGF(usage());
             break;
+        case 's':
+            histsize = strtoul(EARGF(usage()), NULL, 10);
+            break;
+        case 'S':
+            histspill = 1;
+            break;
+        case 'm':
+            membudget = strtoul(EARGF(usage()), NULL, 10);
+            break;
         case 't':
         case 'T':
             opt_title = EARGF(usage());
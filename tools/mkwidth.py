@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+# See LICENSE for license details.
+#
+# Generates inc/width_data.h, the two-stage rune width table used by
+# runewidth(), from the Unicode Character Database:
+#
+#   mkwidth.py UnicodeData.txt EastAsianWidth.txt PropList.txt
+#
+# The files are at https://www.unicode.org/Public/UCD/latest/ucd/.
+#
+# Widths follow the usual wcwidth() rules: nonspacing and enclosing marks,
+# format characters and conjoining medial and final Jamo are 0, East Asian
+# Wide and Fullwidth runes are 2, everything else is 1. Unassigned runes
+# are 1, which is what st made of wcwidth() returning -1 for them, even
+# in the CJK blocks and among the Jamo.
+#
+# Against glibc 2.36 (also Unicode 14.0.0) the table differs only on
+# U+3248..324F and U+4DC0..4DFF, which glibc widens itself while Unicode
+# marks them ambiguous or neutral.
+
+import re
+import sys
+
+NRUNES = 0x110000
+BLKSHIFT = 8
+BLKSIZ = 1 << BLKSHIFT
+
+
+
+def ranges(path):
+    """yields (first, last, fields) for the lines of a UCD file"""
+    for line in open(path, encoding="utf-8"):
+        missing = re.match(r"#\s*@missing:\s*(.*)", line)
+        if missing:
+            line = missing.group(1)
+        line = line.split("#", 1)[0].strip()
+        if not line:
+            continue
+        fields = [f.strip() for f in line.split(";")]
+        cps = fields[0].split("..")
+        yield int(cps[0], 16), int(cps[-1], 16), fields[1:]
+
+
+def version(path):
+    for line in open(path, encoding="utf-8"):
+        m = re.match(r"#\s*\S+-(\d+\.\d+\.\d+)\.txt", line)
+        if m:
+            return m.group(1)
+    return "unknown"
+
+
+def main(unicodedata, eastasianwidth, proplist):
+    cat = ["Cn"] * NRUNES
+    first = None
+    for cp, _, fields in ranges(unicodedata):
+        if fields[0].endswith(", First>"):
+            first = cp
+            continue
+        if fields[0].endswith(", Last>"):
+            cat[first:cp + 1] = [fields[1]] * (cp + 1 - first)
+        else:
+            cat[cp] = fields[1]
+
+    # unassigned runes of the CJK blocks default to W; @missing lines
+    # come first and are overridden by explicit ones
+    eaw = ["N"] * NRUNES
+    for lo, hi in ((0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                   (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)):
+        eaw[lo:hi + 1] = ["W"] * (hi + 1 - lo)
+    for lo, hi, fields in ranges(eastasianwidth):
+        eaw[lo:hi + 1] = [fields[0]] * (hi + 1 - lo)
+
+    # format characters which are visible
+    visible = [False] * NRUNES
+    visible[0xAD] = True
+    for lo, hi, fields in ranges(proplist):
+        if fields[0] == "Prepended_Concatenation_Mark":
+            visible[lo:hi + 1] = [True] * (hi + 1 - lo)
+
+    props = bytearray(NRUNES)
+    for cp in range(NRUNES):
+        c = cat[cp]
+        if c == "Cn":
+            p = 1
+        elif (c in ("Mn", "Me") or (c == "Cf" and not visible[cp]) or
+                0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF or
+                cp == 0x200B):
+            p = 0
+        elif eaw[cp] in ("W", "F"):
+            p = 2
+        else:
+            p = 1
+        props[cp] = p
+
+    blocks, index = {}, []
+    for i in range(0, NRUNES, BLKSIZ):
+        blk = bytes(props[i:i + BLKSIZ])
+        index.append(blocks.setdefault(blk, len(blocks)))
+    if len(blocks) > 256:
+        sys.exit("mkwidth.py: too many distinct blocks for an uchar index")
+
+    out = sys.stdout
+    out.write("/* See LICENSE for license details. */\n\n")
+    out.write("/*\n")
+    out.write(" * Rune widths from Unicode %s, generated by\n" %
+              version(eastasianwidth))
+    out.write(" * tools/mkwidth.py: do not edit.\n")
+    out.write(" *\n")
+    out.write(" * widthtbl[widthidx[u >> %d]][u & 0x%x] is the width of u, 0 to 2.\n" %
+              (BLKSHIFT, BLKSIZ - 1))
+    out.write(" */\n\n")
+
+    out.write("static const unsigned char widthidx[%d] = {\n" % len(index))
+    for i in range(0, len(index), 16):
+        out.write("\t" + ", ".join("%d" % v for v in index[i:i + 16]) + ",\n")
+    out.write("};\n\n")
+
+    out.write("static const unsigned char widthtbl[%d][%d] = {\n" %
+              (len(blocks), BLKSIZ))
+    for blk in blocks:
+        out.write("\t{\n")
+        for i in range(0, BLKSIZ, 16):
+            out.write("\t\t" + ", ".join("%d" % v for v in blk[i:i + 16]) +
+                      ",\n")
+        out.write("\t},\n")
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        sys.exit("usage: mkwidth.py UnicodeData.txt EastAsianWidth.txt "
+                 "PropList.txt")
+    main(*sys.argv[1:])
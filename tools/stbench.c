@@ -0,0 +1,201 @@
+/* See LICENSE for license details. */
+/*
+ * st-bench: replays recorded tty output through st.c without an X server
+ * and reports parser and screen throughput.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+char *argv0;
+#include "arg.h"
+#include "st.h"
+#include "win.h"
+
+/* the same configuration as x.c, with boxdraw on so its paths are measured */
+char *utmp = NULL;
+char *scroll = NULL;
+char *stty_args = "stty raw pass8 nl -echo -iexten -cstopb 38400";
+char *vtiden = "\033[?6c";
+wchar_t *worddelimiters = L" ";
+int allowaltscreen = 1;
+int allowwindowops = 0;
+unsigned int ttyreadmax = 256 * 1024;
+unsigned int histsize = 2000;
+unsigned int histhot = 1000;
+int histspill = 0;
+unsigned int membudget = 0;
+const int boxdraw = 1;
+const int boxdraw_bold = 0;
+const int boxdraw_braille = 1;
+char *termname = "st-256color";
+unsigned int tabspaces = 8;
+float alpha = 1.0;
+unsigned int defaultbg = 256;
+unsigned int defaultfg = 257;
+unsigned int defaultcs = 258;
+
+static void replay(const char *);
+static void usage(void);
+
+static int cols = 80, rows = 24;
+static int count = 1;                 /* times each capture is replayed */
+static size_t chunk = BUFSIZ;         /* bytes per twrite() call */
+static size_t framebytes = 256 * 1024; /* bytes parsed between frames */
+static long frames, drawn;
+
+/* win.h, drawing only counts what it is asked to draw */
+void xbell(void) {}
+void xclipcopy(void) {}
+void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int len) {}
+void xdrawline(Line line, int x1, int y1, int x2) { drawn++; }
+void xfinishdraw(void) { frames++; }
+void xloadcols(void) {}
+int xsetcolorname(int x, const char *name) { return 0; }
+int xgetcolor(int x, unsigned char *r, unsigned char *g, unsigned char *b) { *r = *g = *b = 0; return 0; }
+void xseticontitle(char *p) {}
+void xsettitle(char *p) {}
+int xsetcursor(int cursor) { return !BETWEEN(cursor, 0, 7); }
+void xsetmode(int set, unsigned int flags) {}
+void xsetpointermotion(int set) {}
+void xsetsel(char *str) { free(str); }
+int xstartdraw(void) { return 1; }
+void xximspot(int x, int y) {}
+size_t xmemused(void) { return 0; }
+
+void
+replay(const char *path)
+{
+	struct timespec start, end;
+	struct rusage ru;
+	char *data = NULL, *p;
+	size_t len = 0, size = 0, off, next, lines = 0;
+	ssize_t ret;
+	double secs;
+	int fd, i, n;
+	FILE *out;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		die("open '%s' failed: %s\n", path, strerror(errno));
+	do {
+		if (len == size)
+			data = xrealloc(data, size = size ? size * 2 : BUFSIZ);
+		if ((ret = read(fd, data + len, size - len)) < 0)
+			die("read '%s' failed: %s\n", path, strerror(errno));
+		len += ret;
+	} while (ret > 0);
+	close(fd);
+	for (p = data; (p = memchr(p, '\n', data + len - p)); p++)
+		lines++;
+
+	/*
+	 * Replies to the host go to cmdfd, which is never opened here, and
+	 * the printer to stdout; erresc() noise would be timed as well.
+	 */
+	if (!(out = fdopen(dup(1), "w")))
+		die("fdopen failed: %s\n", strerror(errno));
+	if ((fd = open("/dev/null", O_RDWR)) < 0)
+		die("open '/dev/null' failed: %s\n", strerror(errno));
+	for (i = 0; i < 3; i++)
+		dup2(fd, i);
+
+	tnew(cols, rows);
+	selinit();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++) {
+		for (off = 0, next = framebytes; off < len; off += n) {
+			/*
+			 * twrite() leaves an incomplete UTF-8 sequence behind.
+			 * The history compressor thread shares term as well.
+			 */
+			tlock();
+			n = twrite(data + off, MIN(chunk, len - off), 0);
+			tunlock();
+			if (!n)
+				break;
+			if (off + n >= next) {
+				draw();
+				next += framebytes;
+			}
+		}
+		draw();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = TIMEDIFF(end, start) / 1E3;
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(out, "%-20s %9.2f %9.2f %12.0f %8ld %10ld %10ld\n",
+	       basename((char *)path), (double)len * count / (1 << 20),
+	       (double)len * count / (1 << 20) / secs,
+	       (double)lines * count / secs, frames, drawn, ru.ru_maxrss);
+	fclose(out);
+	free(data);
+}
+
+void
+usage(void)
+{
+	die("usage: %s [-c cols] [-r rows] [-n count] [-b chunk] "
+	    "[-f framebytes] file ...\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pid;
+	int status, ret = 0;
+
+	ARGBEGIN {
+	case 'c':
+		cols = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		rows = atoi(EARGF(usage()));
+		break;
+	case 'n':
+		count = atoi(EARGF(usage()));
+		break;
+	case 'b':
+		chunk = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	case 'f':
+		framebytes = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc == 0 || cols < 1 || rows < 1 || count < 1 || !chunk ||
+	    !framebytes)
+		usage();
+
+	printf("%-20s %9s %9s %12s %8s %10s %10s\n", "capture", "MB",
+	       "MB/s", "lines/s", "frames", "drawn", "rss(KiB)");
+	fflush(stdout);
+
+	/* one process per capture, so every run starts cold and gets its own rss */
+	for (; argc > 0; argc--, argv++) {
+		switch (pid = fork()) {
+		case -1:
+			die("fork failed: %s\n", strerror(errno));
+		case 0:
+			replay(*argv);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)) {
+			fprintf(stderr, "%s: replaying '%s' failed\n", argv0, *argv);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,278 @@
+/* See LICENSE for license details. */
+/*
+ * st-gen: writes reproducible tty output for st-bench, one workload per
+ * code path worth measuring on its own.
+ */
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+char *argv0;
+#include "arg.h"
+#include "st.h"
+
+typedef struct {
+	const char *name;
+	void (*gen)(void);
+} Workload;
+
+static void out(const char *, ...);
+static void outrune(Rune);
+static void outtext(int);
+static uint32_t rnd(uint32_t);
+static void usage(void);
+
+static void gensgr(void);
+static void genscroll(void);
+static void genrepaint(void);
+static void gencjk(void);
+static void genwrap(void);
+static void genbox(void);
+
+static const Workload workloads[] = {
+	{ "sgr",     gensgr },     /* dense 24-bit SGR runs */
+	{ "scroll",  genscroll },  /* scroll region churn */
+	{ "repaint", genrepaint }, /* cursor addressed full screen repaints */
+	{ "cjk",     gencjk },     /* wide CJK and emoji */
+	{ "wrap",    genwrap },    /* very long wrapped lines */
+	{ "box",     genbox },     /* box drawing and braille */
+};
+
+static int cols = 80, rows = 24;
+static uint64_t seed = 1;
+static size_t total;
+
+void
+die(const char *errstr, ...)
+{
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+	exit(1);
+}
+
+void
+out(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	total += vprintf(fmt, ap);
+	va_end(ap);
+}
+
+void
+outrune(Rune u)
+{
+	char buf[4];
+	size_t n;
+
+	if (u < 0x80) {
+		buf[0] = u;
+		n = 1;
+	} else if (u < 0x800) {
+		buf[0] = 0xC0 | u >> 6;
+		buf[1] = 0x80 | (u & 0x3F);
+		n = 2;
+	} else if (u < 0x10000) {
+		buf[0] = 0xE0 | u >> 12;
+		buf[1] = 0x80 | (u >> 6 & 0x3F);
+		buf[2] = 0x80 | (u & 0x3F);
+		n = 3;
+	} else {
+		buf[0] = 0xF0 | u >> 18;
+		buf[1] = 0x80 | (u >> 12 & 0x3F);
+		buf[2] = 0x80 | (u >> 6 & 0x3F);
+		buf[3] = 0x80 | (u & 0x3F);
+		n = 4;
+	}
+	total += fwrite(buf, 1, n, stdout);
+}
+
+/* n columns of words and spaces */
+void
+outtext(int n)
+{
+	for (; n > 0; n--, total++)
+		putchar(rnd(6) ? 'a' + rnd(26) : ' ');
+}
+
+/* xorshift64*, the same stream for the same seed everywhere */
+uint32_t
+rnd(uint32_t n)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (seed * 2685821657736338717ULL >> 32) % n;
+}
+
+void
+gensgr(void)
+{
+	int x;
+
+	for (x = 0; x < cols; x++) {
+		out("\033[38;2;%u;%u;%um\033[48;2;%u;%u;%um",
+		    rnd(256), rnd(256), rnd(256), rnd(256), rnd(256), rnd(256));
+		if (!rnd(8))
+			out("\033[%um", (unsigned[]){1, 3, 4, 7, 22, 23, 24, 27}[rnd(8)]);
+		outrune('!' + rnd(94));
+	}
+	out("\033[0m\r\n");
+}
+
+void
+genscroll(void)
+{
+	int top = 1 + rnd(rows - 1), bot = top + 1 + rnd(rows - top), i;
+
+	out("\033[%d;%dr\033[%d;1H", top, bot, bot);
+	for (i = rnd(2 * rows); i >= 0; i--) {
+		outtext(rnd(cols));
+		out("\r\n");
+	}
+	out("\033[%dH", top);
+	for (i = rnd(rows); i >= 0; i--)
+		out("\033M");
+	out("\033[%dS\033[%dT\033[%dL\033[%dM",
+	    rnd(rows), rnd(rows), rnd(rows), rnd(rows));
+	out("\033[r");
+}
+
+void
+genrepaint(void)
+{
+	int y, x, n;
+
+	out("\033[H");
+	for (y = 1; y <= rows; y++) {
+		out("\033[%d;1H", y);
+		for (x = 0; x < cols; x += n) {
+			n = MIN(1 + rnd(12), cols - x);
+			out("\033[38;5;%u;48;5;%um", rnd(256), rnd(256));
+			outtext(n);
+		}
+		out("\033[0m\033[K");
+	}
+	out("\033[%u;%uH", 1 + rnd(rows), 1 + rnd(cols));
+}
+
+void
+gencjk(void)
+{
+	int x;
+
+	/* a line and a half, so every other line wraps */
+	for (x = 0; x < cols * 3 / 2;) {
+		switch (rnd(10)) {
+		case 0: case 1: case 2: case 3: case 4: case 5:
+			outrune(0x4E00 + rnd(0x5200));
+			x += 2;
+			break;
+		case 6: case 7:
+			outrune(0xAC00 + rnd(0x2BA4));
+			x += 2;
+			break;
+		case 8:
+			outrune(0x1F600 + rnd(0x50)); /* emoticons, all wide */
+			x += 2;
+			break;
+		default:
+			outtext(4);
+			x += 4;
+			break;
+		}
+	}
+	out("\r\n");
+}
+
+void
+genwrap(void)
+{
+	int n;
+
+	for (n = 4096 + rnd(12288); n > 0; n -= 64) {
+		outtext(64);
+		if (!rnd(16))
+			out("\033[3%um", rnd(8));
+	}
+	out("\033[0m\r\n");
+}
+
+void
+genbox(void)
+{
+	int w = 2 + rnd(cols - 1), h = 2 + rnd(rows - 1), x, y;
+	int left = 1 + rnd(cols - w + 1), top = 1 + rnd(rows - h + 1);
+
+	/* a frame with a divider, like the panes of a tui */
+	out("\033[%d;%dH", top, left);
+	for (x = 0; x < w; x++)
+		outrune(x == 0 ? 0x250C : x == w - 1 ? 0x2510 : 0x2500);
+	for (y = 1; y < h - 1; y++) {
+		out("\033[%d;%dH", top + y, left);
+		outrune(y == h / 2 ? 0x251C : 0x2502);
+		out("\033[%d;%dH", top + y, left + w - 1);
+		outrune(y == h / 2 ? 0x2524 : 0x2502);
+	}
+	out("\033[%d;%dH", top + h - 1, left);
+	for (x = 0; x < w; x++)
+		outrune(x == 0 ? 0x2514 : x == w - 1 ? 0x2518 : 0x2500);
+
+	/* a braille graph row, like a cpu meter */
+	out("\033[%u;1H\033[3%um", 1 + rnd(rows), 1 + rnd(7));
+	for (x = 0; x < cols; x++)
+		outrune(0x2800 + rnd(256));
+	out("\033[0m");
+}
+
+void
+usage(void)
+{
+	die("usage: %s [-c cols] [-r rows] [-s seed] [-n bytes] workload\n"
+	    "workloads: sgr scroll repaint cjk wrap box\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t size = 8 << 20;
+	const Workload *w;
+
+	ARGBEGIN {
+	case 'c':
+		cols = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		rows = atoi(EARGF(usage()));
+		break;
+	case 's':
+		seed = strtoull(EARGF(usage()), NULL, 0);
+		break;
+	case 'n':
+		size = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc != 1 || cols < 2 || rows < 2 || !seed)
+		usage();
+	for (w = workloads; w < workloads + LEN(workloads); w++) {
+		if (strcmp(w->name, argv[0]))
+			continue;
+		/* a clean screen of the expected size */
+		out("\033c\033[%d;%dr\033[2J\033[H", 1, rows);
+		while (total < size)
+			w->gen();
+		return 0;
+	}
+	usage();
+
+	return 0;
+}